@@ -11,13 +11,29 @@
 # You should have received a copy of the GNU General Public License along with this program.
 # If not, see <https://www.gnu.org/licenses/>.
 
+import argparse
+import bisect
+import collections
 import configparser
+import contextlib
 import copy
+import ctypes
+import datetime
+import fcntl
+import fnmatch
+import glob
+import json
+import mmap
 import os
+import random
 import re
+import selectors
+import signal
+import socket
 import subprocess
 import sys
 import syslog
+import threading
 import time
 
 
@@ -29,38 +45,1632 @@ def parse_diskstats_line(line):
      1  major number
      2  minor mumber
      3  device name
+     4  reads completed
      6  sectors read
+     8  writes completed
     10  sectors written
+    15  discards completed (since 4.18)
+    19  flush requests completed (since 5.5)
     ==  ===================================
 
     :return: device_name
-    :return: sectors_read
-    :return: sectors_written
+    :return: counters [reads, sectors_read, writes, sectors_written, discards, flushes]
     """
 
     # remove multiple spaces
     line = re.sub(' +', ' ', line).strip().split(' ')
     device_name = line[2]
-    sectors_read = line[5]
-    sectors_written = line[9]
-    return device_name, sectors_read, sectors_written
+    counters = [int(line[index]) if index < len(line) else 0 for index in (3, 5, 7, 9, 14, 18)]
+    return device_name, counters
+
+
+def read_sysfs(path):
+    """Reads single value from sysfs or procfs file"""
+    with open(path, "r") as fd:
+        return fd.read().strip()
+
+
+def write_sysfs(path, value):
+    """Writes single value to sysfs or procfs file"""
+    with open(path, "w") as fd:
+        fd.write(str(value))
+
+
+def write_json(path, data):
+    """Atomically replaces file with JSON dump of data"""
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path + ".tmp", "w") as fd:
+        json.dump(data, fd, indent=1)
+    os.replace(path + ".tmp", path)
+
+
+def check_power_modes(disks):
+    """
+    Checks power mode of disks in parallel without waking them
+
+    :return: {disk: "STANDBY", "ACTIVE" or None if mode is unknown}
+    """
+    # -n standby,3: do not wake disk in STANDBY or SLEEP mode and exit with status 3
+    processes = {
+        disk: subprocess.Popen(
+            ["smartctl", "-n", "standby,3", f"/dev/{disk}"],
+            stdout=subprocess.DEVNULL,
+            stderr=subprocess.STDOUT)
+        for disk in disks
+    }
+    modes = {}
+    for disk, smartctl in processes.items():
+        smartctl.communicate()
+        if smartctl.returncode == 3:
+            modes[disk] = "STANDBY"
+        elif smartctl.returncode & 0b11:  # command line error or device open failed
+            modes[disk] = None
+        else:
+            modes[disk] = "ACTIVE"
+    return modes
+
+
+def suspended_time():
+    """Returns total time system spent in suspend since boot, CLOCK_BOOTTIME - CLOCK_MONOTONIC"""
+    # time.CLOCK_BOOTTIME is available since python 3.7
+    return (
+        time.clock_gettime(getattr(time, "CLOCK_BOOTTIME", 7))
+        - time.clock_gettime(time.CLOCK_MONOTONIC))
+
+
+def parse_duration(text):
+    """Parses duration like 90, 90s, 30m, 2h or 1d to seconds"""
+    units = {"s": 1, "m": 60, "h": 3600, "d": 86400}
+    text = text.strip().lower()
+    if text and text[-1] in units:
+        return float(text[:-1]) * units[text[-1]]
+    return float(text)
+
+
+def parse_seconds(text, minimum=None):
+    """Parses duration to whole seconds, not less than minimum"""
+    seconds = int(parse_duration(text))
+    if minimum is not None and seconds < minimum:
+        raise ValueError(text)
+    return seconds
+
+
+def parse_choice(text, choices):
+    """Parses one of choices, case insensitive"""
+    value = text.strip().lower()
+    if value not in choices:
+        raise ValueError(text)
+    return value
+
+
+def parse_bool(text):
+    """Parses yes/no, on/off, true/false or 1/0 like configparser"""
+    try:
+        return configparser.ConfigParser.BOOLEAN_STATES[text.strip().lower()]
+    except KeyError:
+        raise ValueError(text)
+
+
+def config_option(section, name, default, parse=int, minimum=None):
+    """
+    Parses option of config section. Invalid value is logged and default is used instead, so
+    typo in config does not stop daemon on start or reload
+    """
+    if name not in section:
+        return default
+    try:
+        value = parse(section[name])
+        if minimum is not None and value < minimum:
+            raise ValueError(value)
+        return value
+    except ValueError:
+        syslog.syslog(syslog.LOG_WARNING,
+                      f"Invalid config record for '{name}', setting default value {default}")
+        return default
+
+
+def wake_disk(disk):
+    """Spins disk up by reading random sector, bypassing page cache"""
+    size = int(read_sysfs(f"/sys/block/{disk}/size")) * 512
+    block = 4096
+    # O_DIRECT needs aligned buffer, anonymous mmap is page aligned
+    buffer = mmap.mmap(-1, block)
+    fd = os.open(f"/dev/{disk}", os.O_RDONLY | os.O_DIRECT)
+    try:
+        os.lseek(fd, random.randrange(max(size // block, 1)) * block, os.SEEK_SET)
+        os.readv(fd, [buffer])
+    finally:
+        os.close(fd)
+        buffer.close()
+
+
+# Kernel names of disks to monitor when no devices are configured
+DISK_PATTERN = "([sh]d[a-z]|nvme[0-9]+n[0-9]+)\\Z"
+
+# Power tiers from shallowest to deepest. ATA disks have standby (hdparm -y) and sleep (hdparm -yY)
+# only, SCSI disks have idle and standby power conditions of START STOP UNIT
+TIERS = ("idle_b", "idle_c", "standby_y", "standby_z", "standby", "sleep")
+
+
+def detect_protocol(disk):
+    """
+    Detects command set of disk: ata for libata and IDE disks, nvme for NVMe namespaces, sat for
+    USB disks behind SAT bridges, scsi for other SCSI disks
+    """
+    if disk.startswith("nvme"):
+        return "nvme"
+    if disk.startswith("hd"):
+        return "ata"
+    if "/usb" in os.path.realpath(f"/sys/block/{disk}"):
+        return "sat"
+    try:
+        # libata reports vendor "ATA" for all disks it translates SCSI commands for
+        vendor = read_sysfs(f"/sys/block/{disk}/device/vendor")
+    except OSError:
+        return "ata"
+    return "ata" if vendor == "ATA" else "scsi"
+
+
+class AtaBackend:
+    """ATA disks: power mode is checked with smartctl, disk is stopped with hdparm"""
+
+    check_command = "smartctl"
+    stop_command = "hdparm"
+    parallel = True  # power modes of many disks are checked at once
+    tiers = ("standby", "sleep")  # distinct tiers, from shallowest
+
+    def power_modes(self, tiers):
+        """:return: {disk: "STANDBY", "ACTIVE" or None if mode is unknown}"""
+        return check_power_modes(list(tiers))
+
+    def stop(self, disk, tier):
+        """Stops disk, returns True on success"""
+        flags = "-yY" if tier == "sleep" else "-y"  # ATA has no idle tiers
+        process = subprocess.Popen(["hdparm", flags, f"/dev/{disk}"],
+                                   stdout=subprocess.DEVNULL, stderr=subprocess.STDOUT)
+        process.communicate()
+        return process.returncode == 0
+
+
+SG_IO = 0x2285
+SG_DXFER_NONE = -1
+SG_DXFER_FROM_DEV = -3
+
+
+class SgIoHdr(ctypes.Structure):
+    """struct sg_io_hdr from <scsi/sg.h>"""
+
+    _fields_ = [
+        ("interface_id", ctypes.c_int),
+        ("dxfer_direction", ctypes.c_int),
+        ("cmd_len", ctypes.c_ubyte),
+        ("mx_sb_len", ctypes.c_ubyte),
+        ("iovec_count", ctypes.c_ushort),
+        ("dxfer_len", ctypes.c_uint),
+        ("dxferp", ctypes.c_void_p),
+        ("cmdp", ctypes.c_void_p),
+        ("sbp", ctypes.c_void_p),
+        ("timeout", ctypes.c_uint),  # milliseconds
+        ("flags", ctypes.c_uint),
+        ("pack_id", ctypes.c_int),
+        ("usr_ptr", ctypes.c_void_p),
+        ("status", ctypes.c_ubyte),
+        ("masked_status", ctypes.c_ubyte),
+        ("msg_status", ctypes.c_ubyte),
+        ("sb_len_wr", ctypes.c_ubyte),
+        ("host_status", ctypes.c_ushort),
+        ("driver_status", ctypes.c_ushort),
+        ("resid", ctypes.c_int),
+        ("duration", ctypes.c_uint),
+        ("info", ctypes.c_uint),
+    ]
+
+
+def sg_io(fd, cdb, length=0, timeout=30, ioctl=fcntl.ioctl):
+    """
+    Sends SCSI command to open device with SG_IO ioctl, reading up to length bytes of data
+
+    :return: SCSI status, data, sense data
+    :raises OSError: if ioctl fails or command does not reach device
+    """
+    command = (ctypes.c_ubyte * len(cdb))(*cdb)
+    data = ctypes.create_string_buffer(length)
+    sense = ctypes.create_string_buffer(32)
+    header = SgIoHdr(
+        interface_id=ord("S"),
+        dxfer_direction=SG_DXFER_FROM_DEV if length else SG_DXFER_NONE,
+        cmd_len=len(cdb), mx_sb_len=len(sense), dxfer_len=length,
+        dxferp=ctypes.cast(data, ctypes.c_void_p), cmdp=ctypes.cast(command, ctypes.c_void_p),
+        sbp=ctypes.cast(sense, ctypes.c_void_p), timeout=timeout * 1000)
+    ioctl(fd, SG_IO, header)
+    # Low bits of driver_status are errors, DRIVER_SENSE (0x08) only flags valid sense data
+    if header.host_status or header.driver_status & 0x07:
+        raise OSError(f"SG_IO host status {header.host_status:#x}, "
+                      f"driver status {header.driver_status:#x}")
+    return (header.status, data.raw[:length - header.resid],
+            sense.raw[:header.sb_len_wr])
+
+
+def parse_sense(sense):
+    """:return: sense key, additional sense code, qualifier of fixed or descriptor sense data"""
+    if len(sense) >= 4 and sense[0] & 0x7F in (0x72, 0x73):
+        return sense[1] & 0x0F, sense[2], sense[3]
+    if len(sense) >= 14 and sense[0] & 0x7F in (0x70, 0x71):
+        return sense[2] & 0x0F, sense[12], sense[13]
+    return None, None, None
+
+
+class ScsiBackend:
+    """
+    SCSI (SAS) disks: power condition is read with REQUEST SENSE, disk is moved to idle or
+    standby power condition with START STOP UNIT. Media access wakes disk up, unlike stopped state
+    """
+
+    check_command = "request_sense"
+    stop_command = "start_stop_unit"
+    parallel = False
+    tiers = ("idle_b", "idle_c", "standby_y", "standby_z")
+
+    # Power conditions from shallowest to deepest
+    DEPTH = ("active", "idle_a", "idle_b", "idle_c", "standby_y", "standby_z", "stopped")
+    # Power condition reported with ASC 0x5E LOW POWER CONDITION ON, by ASCQ
+    CONDITIONS = {
+        0x00: "standby_z", 0x01: "idle_a", 0x02: "standby_z", 0x03: "idle_a", 0x04: "standby_z",
+        0x05: "idle_b", 0x06: "idle_b", 0x07: "idle_c", 0x08: "idle_c", 0x09: "standby_y",
+        0x0A: "standby_y",
+    }
+    # tier: power condition requested with START STOP UNIT
+    TIER_CONDITIONS = {
+        "idle_b": "idle_b", "idle_c": "idle_c", "standby_y": "standby_y",
+        "standby_z": "standby_z", "standby": "standby_z", "sleep": "standby_z",
+    }
+    # power condition: POWER CONDITION and POWER CONDITION MODIFIER fields of START STOP UNIT
+    START_STOP = {
+        "idle_b": (0x2, 0x1), "idle_c": (0x2, 0x2), "standby_y": (0x3, 0x1),
+        "standby_z": (0x3, 0x0),
+    }
+
+    def __init__(self, ioctl=fcntl.ioctl):
+        """ioctl is replaceable, so backend can be tested with fake SG handler"""
+        self.ioctl = ioctl
+
+    def command(self, disk, cdb, length=0, timeout=30):
+        fd = os.open(f"/dev/{disk}", os.O_RDONLY | os.O_NONBLOCK)
+        try:
+            return sg_io(fd, cdb, length, timeout, self.ioctl)
+        finally:
+            os.close(fd)
+
+    def power_condition(self, disk):
+        """Reads power condition from sense data, REQUEST SENSE does not change it"""
+        status, data, _ = self.command(disk, [0x03, 0, 0, 0, 252, 0], 252)
+        if status != 0:
+            raise OSError(f"REQUEST SENSE status {status:#x}")
+        key, asc, ascq = parse_sense(data)
+        if asc == 0x5E:
+            return self.CONDITIONS.get(ascq, "standby_z")
+        if key == 0x2 and asc == 0x04 and ascq in (0x02, 0x11):  # NOT READY, start required
+            return "stopped"
+        return "active"
+
+    def power_modes(self, tiers):
+        """
+        :return: {disk: "STANDBY" if disk is in power condition of its tier or deeper,
+                  "ACTIVE" or None if mode is unknown}
+        """
+        modes = {}
+        for disk, tier in tiers.items():
+            try:
+                condition = self.power_condition(disk)
+            except OSError:
+                modes[disk] = None
+                continue
+            target = self.TIER_CONDITIONS[tier]
+            modes[disk] = (
+                "STANDBY" if self.DEPTH.index(condition) >= self.DEPTH.index(target)
+                else "ACTIVE")
+        return modes
+
+    def stop(self, disk, tier):
+        """Moves disk to power condition of tier, returns True on success"""
+        condition, modifier = self.START_STOP[self.TIER_CONDITIONS[tier]]
+        try:
+            status, _, _ = self.command(
+                disk, [0x1B, 0, 0, modifier, condition << 4, 0], timeout=60)
+        except OSError:
+            return False
+        return status == 0
+
+
+def bridge_id(disk):
+    """Returns USB vendor:product of bridge disk is connected through, or disk if there is none"""
+    path = os.path.realpath(f"/sys/block/{disk}/device")
+    while path != "/":
+        try:
+            return f"{read_sysfs(f'{path}/idVendor')}:{read_sysfs(f'{path}/idProduct')}"
+        except OSError:
+            path = os.path.dirname(path)
+    return disk
+
+
+def ata_return(sense):
+    """
+    Extracts ATA registers from sense data of ATA PASS-THROUGH with CK_COND set
+
+    :return: status, count or None if sense data has no ATA registers
+    """
+    _, asc, ascq = parse_sense(sense)
+    if (asc, ascq) != (0x00, 0x1D):  # ATA PASS THROUGH INFORMATION AVAILABLE
+        return None
+    if sense[0] & 0x7F == 0x72:
+        # ATA Status Return descriptor
+        offset = 8
+        while offset + 14 <= len(sense):
+            if sense[offset] == 0x09:
+                return sense[offset + 13], sense[offset + 5]
+            offset += sense[offset + 1] + 2
+        return None
+    # Fixed format: ERROR, STATUS, DEVICE and COUNT in INFORMATION field
+    return sense[4], sense[6]
+
+
+class SatBackend(ScsiBackend):
+    """
+    Disks behind SAT bridges (USB docks and enclosures): CHECK POWER MODE and STANDBY IMMEDIATE
+    are sent through SCSI ATA PASS-THROUGH. Bridges support 16 or 12 byte variant or both, the one
+    working is found once and cached per bridge
+    """
+
+    check_command = "check_power_mode"
+    stop_command = "standby_immediate"
+    tiers = ("standby",)
+
+    CHECK_POWER_MODE = 0xE5
+    STANDBY_IMMEDIATE = 0xE0
+
+    def __init__(self, ioctl=fcntl.ioctl):
+        super().__init__(ioctl)
+        self.variants = {}  # bridge: 16, 12 or None if neither works
+
+    @staticmethod
+    def pass_through(variant, command, check):
+        """Builds ATA PASS-THROUGH CDB of non-data command, check requests ATA registers back"""
+        # PROTOCOL 3 (non-data), CK_COND
+        flags = [3 << 1, 0x20 if check else 0x00]
+        if variant == 16:
+            return [0x85] + flags + [0] * 11 + [command, 0]
+        return [0xA1] + flags + [0] * 6 + [command, 0, 0]
+
+    def variant(self, disk):
+        """Finds ATA PASS-THROUGH variant supported by bridge of disk"""
+        bridge = bridge_id(disk)
+        if bridge not in self.variants:
+            self.variants[bridge] = None
+            for variant in (16, 12):
+                try:
+                    _, _, sense = self.command(
+                        disk, self.pass_through(variant, self.CHECK_POWER_MODE, True))
+                except OSError:
+                    continue
+                if ata_return(sense) is not None:
+                    self.variants[bridge] = variant
+                    break
+            syslog.syslog(
+                syslog.LOG_INFO if self.variants[bridge] else syslog.LOG_WARNING,
+                f"Bridge {bridge} of {disk}: "
+                + (f"ATA PASS-THROUGH({self.variants[bridge]})" if self.variants[bridge]
+                   else "Can not find working ATA PASS-THROUGH"))
+        return self.variants[bridge]
+
+    def power_modes(self, tiers):
+        """:return: {disk: "STANDBY", "ACTIVE" or None if mode is unknown}"""
+        modes = {}
+        for disk in tiers:
+            modes[disk] = None
+            try:
+                variant = self.variant(disk)
+                if variant is None:
+                    continue
+                _, _, sense = self.command(
+                    disk, self.pass_through(variant, self.CHECK_POWER_MODE, True))
+            except OSError:
+                continue
+            registers = ata_return(sense)
+            if registers is not None and not registers[0] & 0x01:  # ERR
+                # Count 0x00 is standby, 0x01 is standby_y of EPC
+                modes[disk] = "STANDBY" if registers[1] in (0x00, 0x01) else "ACTIVE"
+        return modes
+
+    def stop(self, disk, tier):
+        """
+        Sends STANDBY IMMEDIATE for all tiers, bridges often can not wake disks from SLEEP.
+        Returns True on success
+        """
+        try:
+            variant = self.variant(disk)
+            if variant is None:
+                return False
+            status, _, _ = self.command(
+                disk, self.pass_through(variant, self.STANDBY_IMMEDIATE, False), timeout=60)
+        except OSError:
+            return False
+        return status == 0
+
+
+NVME_IOCTL_ADMIN_CMD = 0xC0484E41
+
+
+class NvmeAdminCmd(ctypes.Structure):
+    """struct nvme_admin_cmd from <linux/nvme_ioctl.h>"""
+
+    _fields_ = [
+        ("opcode", ctypes.c_uint8),
+        ("flags", ctypes.c_uint8),
+        ("rsvd1", ctypes.c_uint16),
+        ("nsid", ctypes.c_uint32),
+        ("cdw2", ctypes.c_uint32),
+        ("cdw3", ctypes.c_uint32),
+        ("metadata", ctypes.c_uint64),
+        ("addr", ctypes.c_uint64),
+        ("metadata_len", ctypes.c_uint32),
+        ("data_len", ctypes.c_uint32),
+        ("cdw10", ctypes.c_uint32),
+        ("cdw11", ctypes.c_uint32),
+        ("cdw12", ctypes.c_uint32),
+        ("cdw13", ctypes.c_uint32),
+        ("cdw14", ctypes.c_uint32),
+        ("cdw15", ctypes.c_uint32),
+        ("timeout_ms", ctypes.c_uint32),
+        ("result", ctypes.c_uint32),
+    ]
+
+
+class NvmeBackend:
+    """
+    NVMe namespaces: power state of controller is read and set with Get and Set Features
+    (Power Management). Non-operational power states are taken from Identify Controller. The
+    controller returns to operational state by itself on next I/O command
+    """
+
+    check_command = "get_features"
+    stop_command = "set_features"
+    parallel = False
+    tiers = ("standby", "sleep")
+
+    IDENTIFY = 0x06
+    SET_FEATURES = 0x09
+    GET_FEATURES = 0x0A
+    POWER_MANAGEMENT = 0x02
+    APST = 0x0C  # autonomous power state transitions
+
+    def __init__(self, ioctl=fcntl.ioctl):
+        """ioctl is replaceable, so backend can be tested without NVMe devices"""
+        self.ioctl = ioctl
+        self.nonoperational = {}  # disk: non-operational power states, shallowest first
+
+    def command(self, disk, opcode, cdw10=0, cdw11=0, length=0):
+        """Sends admin command to controller of namespace, returns result and data"""
+        data = ctypes.create_string_buffer(length)
+        command = NvmeAdminCmd(
+            opcode=opcode, addr=ctypes.addressof(data), data_len=length, cdw10=cdw10,
+            cdw11=cdw11, timeout_ms=30000)
+        fd = os.open(f"/dev/{disk}", os.O_RDONLY | os.O_NONBLOCK)
+        try:
+            status = self.ioctl(fd, NVME_IOCTL_ADMIN_CMD, command)
+        finally:
+            os.close(fd)
+        # ioctl returns positive NVMe status if command failed on controller
+        if status:
+            raise OSError(f"NVMe admin command {opcode:#x} status {status:#x}")
+        return command.result, data.raw
+
+    def power_states(self, disk):
+        """Returns non-operational power states of controller, shallowest first"""
+        if disk not in self.nonoperational:
+            _, data = self.command(disk, self.IDENTIFY, cdw10=1, length=4096)  # CNS 1: controller
+            states = []
+            # NPSS is zero based, power state descriptors are 32 bytes each from byte 2048
+            for state in range(data[263] + 1):
+                descriptor = data[2048 + state * 32:2048 + (state + 1) * 32]
+                if descriptor[3] & 0x02:  # NOPS
+                    exit_latency = int.from_bytes(descriptor[8:12], "little")
+                    states.append((exit_latency, state))
+            self.nonoperational[disk] = [state for _, state in sorted(states)]
+            apst, _ = self.command(disk, self.GET_FEATURES, cdw10=self.APST)
+            syslog.syslog(
+                syslog.LOG_INFO,
+                f"{disk}: non-operational power states "
+                f"{', '.join(map(str, self.nonoperational[disk])) or 'none'}, "
+                f"APST {'enabled' if apst & 0x01 else 'disabled'}")
+        return self.nonoperational[disk]
+
+    def power_modes(self, tiers):
+        """
+        :return: {disk: "STANDBY" if controller is in non-operational power state, "ACTIVE" or
+                  None if mode is unknown}
+        """
+        modes = {}
+        for disk in tiers:
+            try:
+                states = self.power_states(disk)
+                result, _ = self.command(disk, self.GET_FEATURES, cdw10=self.POWER_MANAGEMENT)
+            except OSError:
+                modes[disk] = None
+                continue
+            modes[disk] = "STANDBY" if result & 0x1F in states else "ACTIVE"
+        return modes
+
+    def stop(self, disk, tier):
+        """
+        Moves controller to non-operational power state, shallowest one for standby tier and
+        deepest for others. Returns True on success
+        """
+        try:
+            states = self.power_states(disk)
+            if not states:
+                return False
+            state = states[0] if tier == "standby" else states[-1]
+            self.command(disk, self.SET_FEATURES, cdw10=self.POWER_MANAGEMENT, cdw11=state)
+        except OSError:
+            return False
+        return True
+
+
+ENERGY_KINDS = ("consumed", "saved", "spinup", "net")
+
+
+def disk_energy(policy, seconds, wakeups):
+    """
+    Energy balance of disk in joules from seconds spent in states: consumed, saved against
+    always spinning disk (time in POWEROFF would be spent idle), spent on spin-ups and net savings
+    """
+    spinup = wakeups * policy.spinup_watts * policy.spinup_seconds
+    consumed = (
+        seconds.get("ACTIVE", 0) * policy.active_watts
+        + seconds.get("IDLE", 0) * policy.idle_watts
+        + seconds.get("POWEROFF", 0) * policy.standby_watts
+        + spinup)
+    saved = seconds.get("POWEROFF", 0) * (policy.idle_watts - policy.standby_watts)
+    return {"consumed": consumed, "saved": saved, "spinup": spinup, "net": saved - spinup}
+
+
+def profiled_spinup(profiles, identity, tier):
+    """Median wake-up time of drive from tier measured by profile command, None if unknown"""
+    samples = sorted(seconds for _, seconds in profiles.get(identity, {}).get(tier, []))
+    return samples[len(samples) // 2] if samples else None
+
+
+BACKENDS = {"ata": AtaBackend, "scsi": ScsiBackend, "sat": SatBackend, "nvme": NvmeBackend}
+
+
+def disk_ids(disk):
+    """Returns names disk is known by: kernel name and /dev/disk/by-id links"""
+    ids = {disk}
+    try:
+        for name in os.listdir("/dev/disk/by-id"):
+            if os.path.basename(os.path.realpath(f"/dev/disk/by-id/{name}")) == disk:
+                ids.add(name)
+    except OSError:
+        pass
+    return ids
+
+
+def drive_identity(disk):
+    """
+    Returns name identifying the drive itself rather than its slot: /dev/disk/by-id name with
+    model and serial number, or kernel name if there is none
+    """
+    names = sorted(disk_ids(disk) - {disk})
+    # wwn- and eui. names do not tell model, prefer names like ata-MODEL_SERIAL
+    preferred = [name for name in names if not name.startswith(("wwn-", "nvme-eui."))]
+    return (preferred or names or [disk])[0]
+
+
+class Policy:
+    """
+    Per-disk settings. Compiled from [disks-poweroff], [group:<name>] and [disk:<id>] sections
+    at config load, so polling cycle does no config lookups
+    """
+
+    __slots__ = (
+        "timeout", "tier", "read_sectors", "read_ops", "write_sectors", "write_ops",
+        "quiet_samples", "ignore_discard_flush", "schedule", "nosleep", "protocol", "runtime_pm",
+        "active_watts", "idle_watts", "standby_watts", "spinup_watts", "spinup_seconds")
+
+    # name: parser of config value
+    FIELDS = {
+        "timeout": lambda value: parse_seconds(value, minimum=0),
+        "tier": lambda value: parse_choice(value, TIERS),
+        "read_sectors": int,
+        "read_ops": int,
+        "write_sectors": int,
+        "write_ops": int,
+        "quiet_samples": lambda value: max(int(value), 1),
+        "ignore_discard_flush": parse_bool,
+        "schedule": lambda value: value.strip(),
+        "nosleep": parse_bool,
+        "protocol": lambda value: parse_choice(value, ("auto", "ata", "scsi", "sat", "nvme")),
+        "runtime_pm": parse_bool,
+        "active_watts": float,
+        "idle_watts": float,
+        "standby_watts": float,
+        "spinup_watts": float,
+        "spinup_seconds": float,
+    }
+
+    def __init__(self, **settings):
+        for name, value in settings.items():
+            setattr(self, name, value)
+
+    def copy(self):
+        return Policy(**{name: getattr(self, name) for name in self.__slots__})
+
+    def update(self, section, source):
+        """Overrides settings present in config section"""
+        for name, parse in self.FIELDS.items():
+            if name not in section:
+                continue
+            try:
+                setattr(self, name, parse(section[name]))
+            except (KeyError, ValueError):
+                syslog.syslog(syslog.LOG_WARNING,
+                              f"Invalid config record for '{name}' in [{source}], ignored")
+
+
+def default_policy(section, timeout):
+    """Builds policy from [disks-poweroff] section"""
+    # Power tier: standby (hdparm -y) or sleep (hdparm -yY), sleep needs longer to wake up.
+    # SCSI disks also have idle_b, idle_c, standby_y and standby_z power conditions
+    # Protocol: ata, scsi or auto to detect it from sysfs
+    # Runtime PM: let kernel stop disk after timeout, daemon only watches runtime_status
+    # Activity thresholds: minimum sectors or operations per polling interval to count as
+    # activity, 0 disables threshold. Disk becomes idle after quiet_samples quiet polls
+    # Power draw for energy accounting, defaults are typical for 3.5" HDD
+    default = Policy(
+        timeout=timeout, tier="sleep", read_sectors=1, read_ops=0, write_sectors=1,
+        write_ops=0, quiet_samples=1, ignore_discard_flush=True, schedule=None, nosleep=False,
+        protocol="auto", runtime_pm=False, active_watts=6.0, idle_watts=4.5, standby_watts=0.8,
+        spinup_watts=20.0, spinup_seconds=10.0)
+    default.update(
+        {name: value for name, value in section.items()
+         if name in Policy.FIELDS and name != "timeout"},
+        "disks-poweroff")
+    return default
+
+
+def compile_policies(config, disks, default, groups=None):
+    """
+    Builds policy of every disk: defaults are overridden by model sections matching the disk,
+    by groups the disk belongs to and then by its own section. Disk and group members are matched
+    by kernel name or /dev/disk/by-id name, models by glob on model name or /dev/disk/by-id name.
+    Members of groups are stored to groups dict, if passed
+    """
+    ids = {disk: disk_ids(disk) for disk in disks}
+
+    def matching(names):
+        names = {name.strip().split("/")[-1] for name in names if name.strip()}
+        return [disk for disk in disks if ids[disk] & names]
+
+    def model(disk):
+        try:
+            return read_sysfs(f"/sys/block/{disk}/device/model")
+        except OSError:
+            return ""
+
+    policies = {disk: default.copy() for disk in disks}
+    for section in config.sections():
+        if section.startswith("model:"):
+            pattern = section[len("model:"):].strip()
+            for disk in disks:
+                if any(fnmatch.fnmatch(name, pattern) for name in ids[disk] | {model(disk)}):
+                    policies[disk].update(config[section], section)
+    for section in config.sections():
+        if section.startswith("group:"):
+            members = matching(config[section].get("devices", "").split(","))
+            if groups is not None:
+                groups[section[len("group:"):]] = members
+            for disk in members:
+                policies[disk].update(config[section], section)
+    for section in config.sections():
+        if section.startswith("disk:"):
+            for disk in matching([section[len("disk:"):]]):
+                policies[disk].update(config[section], section)
+    return policies
+
+
+WEEK = 7 * 24 * 60  # minutes
+DAYS = ("mon", "tue", "wed", "thu", "fri", "sat", "sun")
+
+
+def parse_days(text):
+    """Parses days like *, mon-fri or sat,sun to list of weekday numbers, monday is 0"""
+    if text == "*":
+        return list(range(7))
+    days = []
+    for part in text.split(","):
+        first, _, last = part.partition("-")
+        first = DAYS.index(first)
+        last = DAYS.index(last) if last else first
+        days.extend(day % 7 for day in range(first, last + 1 if last >= first else last + 8))
+    return days
+
+
+def parse_time(text):
+    """Parses HH:MM to minutes since midnight, 24:00 is the end of day"""
+    hours, minutes = (int(part) for part in text.split(":"))
+    if not (0 <= hours < 24 and 0 <= minutes < 60 or (hours, minutes) == (24, 0)):
+        raise ValueError(text)
+    return hours * 60 + minutes
+
+
+class Schedule:
+    """
+    Weekly schedule from [schedule:<name>] section. Every record is a block like
+
+        business = mon-fri 08:00-19:00 nosleep
+        night = * 22:00-06:00 timeout=10m tier=sleep
+
+    Blocks are compiled at load time to sorted transition points (minutes since monday 00:00),
+    each with policy overrides valid until the next point. Later blocks win on overlap
+    """
+
+    def __init__(self, name, section):
+        blocks = []  # (start, end, overrides), minutes of week
+        for key, value in section.items():
+            try:
+                days, period, *actions = value.split()
+                start, end = (parse_time(part) for part in period.split("-"))
+                overrides = {}
+                for action in actions:
+                    if action == "nosleep":
+                        overrides["nosleep"] = True
+                        continue
+                    field, setting = action.split("=", 1)
+                    if field not in Policy.FIELDS or field == "schedule":
+                        raise ValueError(field)
+                    overrides[field] = Policy.FIELDS[field](setting)
+                if end <= start:  # over midnight
+                    end += 24 * 60
+                for day in parse_days(days.lower()):
+                    blocks.append((day * 24 * 60 + start, day * 24 * 60 + end, overrides))
+            except (KeyError, ValueError):
+                syslog.syslog(syslog.LOG_WARNING,
+                              f"Invalid schedule block '{key}' in [schedule:{name}], ignored")
+
+        # Blocks wrapping around the end of week continue from monday
+        spans = []
+        for start, end, overrides in blocks:
+            spans.append((start, min(end, WEEK), overrides))
+            if end > WEEK:
+                spans.append((0, end - WEEK, overrides))
+        self.points = sorted({0} | {point for start, end, _ in spans for point in (start, end)
+                                    if point < WEEK})
+        self.overrides = []
+        for point in self.points:
+            merged = {}
+            for start, end, overrides in spans:
+                if start <= point < end:
+                    merged.update(overrides)
+            self.overrides.append(merged)
+
+    def at(self, minute):
+        """Returns overrides at minute of week and minute of week of the next transition"""
+        index = bisect.bisect_right(self.points, minute) - 1
+        if index + 1 < len(self.points):
+            return self.overrides[index], self.points[index + 1]
+        return self.overrides[index], WEEK + self.points[0]
+
+
+class ControlError(Exception):
+    """Invalid control command"""
+
+
+class CoAccessGraph:
+    """
+    Learned co-access of drives: drives becoming active within window seconds of each other
+    strengthen their edge. Activation counts and edge weights decay with half-life, so the graph
+    follows workload changes. Keyed by drive identity and wall clock, so it survives reboots
+    """
+
+    def __init__(self, window, half_life):
+        self.window = window
+        self.half_life = half_life
+        self.activations = {}  # drive: [decayed count, time of update]
+        self.edges = {}  # "drive1 drive2", sorted: [decayed weight, time of update]
+        self.recent = {}  # drive: time of last activation
+        self.changed = False
+
+    def decayed(self, entry, now):
+        return entry[0] * 0.5 ** ((now - entry[1]) / max(self.half_life, 1))
+
+    def increment(self, table, key, now):
+        table[key] = [self.decayed(table.get(key, [0, now]), now) + 1, now]
+
+    def activated(self, drive, now):
+        """
+        Records activation of drive and links it to drives activated within window, unless
+        the pair was already linked at previous activation of drive
+        """
+        self.increment(self.activations, drive, now)
+        previous = self.recent.get(drive, float("-inf"))
+        for other, when in self.recent.items():
+            if other != drive and now - when <= self.window and when > previous:
+                self.increment(self.edges, " ".join(sorted((drive, other))), now)
+        self.recent[drive] = now
+        self.changed = True
+
+    def partners(self, drive, threshold, now):
+        """Returns drives co-accessed with drive in at least threshold share of its activations"""
+        count = self.decayed(self.activations.get(drive, [0, now]), now)
+        if count < 2:  # too little evidence
+            return []
+        partners = []
+        for key, entry in self.edges.items():
+            first, second = key.split(" ")
+            if drive in (first, second) and self.decayed(entry, now) / count >= threshold:
+                partners.append(second if first == drive else first)
+        return partners
+
+    def to_dict(self, now):
+        """Returns weights with faded entries dropped"""
+        return {
+            table: {key: entry for key, entry in getattr(self, table).items()
+                    if self.decayed(entry, now) >= 0.05}
+            for table in ("activations", "edges")
+        }
+
+    def from_dict(self, data):
+        self.activations = data.get("activations", {})
+        self.edges = data.get("edges", {})
+
+
+def boot_id():
+    """Returns random id of current boot"""
+    try:
+        return read_sysfs("/proc/sys/kernel/random/boot_id")
+    except OSError:
+        return None
+
+
+class Histogram:
+    """Histogram with fixed buckets, values are in seconds"""
+
+    BUCKETS = (0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30)
+
+    def __init__(self, buckets=BUCKETS):
+        self.buckets = buckets
+        self.counts = [0] * (len(buckets) + 1)  # last one is +Inf
+        self.sum = 0.0
+        self.count = 0
+        self.max = 0.0
+
+    def observe(self, value):
+        self.counts[bisect.bisect_left(self.buckets, value)] += 1
+        self.sum += value
+        self.count += 1
+        self.max = max(self.max, value)
+
+    def quantile(self, q):
+        """Estimates quantile as upper bound of bucket containing it"""
+        rank = q * self.count
+        cumulative = 0
+        for bucket, count in zip(self.buckets, self.counts):
+            cumulative += count
+            if cumulative >= rank:
+                return min(bucket, self.max)
+        return self.max
+
+
+# Stage timings: 1 us to 67 s, doubling
+TIMING_BUCKETS = tuple(0.000001 * 2 ** i for i in range(27))
+
+
+class DiskStats:
+    """Per-disk counters, exported as metrics and saved with state"""
+
+    COUNTERS = (
+        "spindowns", "wakeups", "false_wakes", "thrashes", "predicted_wakes", "prediction_hits",
+        "prediction_misses", "prediction_saved_seconds")
+    COMMAND_COUNTERS = ("commands", "command_failures", "command_seconds")
+
+    def __init__(self):
+        self.seconds = collections.Counter()  # state: seconds spent in state
+        self.entered = time.monotonic()  # when current state was entered
+        self.woken = False  # disk is active after wake-up
+        self.spindowns = 0
+        self.wakeups = 0
+        # Wake-ups with activity during single poll only, disk was woken for nothing useful
+        self.false_wakes = 0
+        # Wake-ups soon after spin-down. Each multiplies timeout by backoff, which decays to 1
+        self.thrashes = 0
+        # Disk woken because its partner woke up: hits are used before deadline, misses are not
+        self.predicted_wakes = 0
+        self.prediction_hits = 0
+        self.prediction_misses = 0
+        self.prediction_saved_seconds = 0.0  # spin-up time users did not wait for
+        self.backoff = 1.0
+        self.backoff_changed = time.monotonic()
+        self.spun_down_by = ""  # cause of last transition to POWEROFF
+        self.commands = collections.Counter()  # command: number of runs
+        self.command_failures = collections.Counter()
+        self.command_seconds = collections.Counter()
+
+    def to_dict(self):
+        data = {name: getattr(self, name) for name in self.COUNTERS}
+        for name in ("seconds",) + self.COMMAND_COUNTERS:
+            data[name] = dict(getattr(self, name))
+        data["backoff"] = [self.backoff, self.backoff_changed]
+        return data
+
+    def from_dict(self, data):
+        for name in self.COUNTERS:
+            setattr(self, name, data.get(name, 0))
+        for name in ("seconds",) + self.COMMAND_COUNTERS:
+            setattr(self, name, collections.Counter(data.get(name, {})))
+        self.backoff, self.backoff_changed = data.get("backoff", [1.0, time.monotonic()])
+
+
+def prometheus_labels(labels):
+    """Formats dict as Prometheus labels"""
+    def escape(value):
+        return str(value).replace("\\", "\\\\").replace('"', '\\"').replace("\n", "\\n")
+
+    return ",".join(f'{name}="{escape(value)}"' for name, value in labels.items())
+
+
+class EventLog:
+    """
+    Sends structured events natively to journald, with fields, or to syslog if journald is not
+    available. At most rate_limit events per minute are sent, the rest are counted as suppressed
+    """
+
+    JOURNAL_SOCKET = "/run/systemd/journal/socket"
+
+    def __init__(self, rate_limit):
+        self.rate_limit = rate_limit
+        self.tokens = rate_limit
+        self.refilled = time.monotonic()
+        self.suppressed = 0
+        self.journal = None
+        if os.path.exists(self.JOURNAL_SOCKET):
+            self.journal = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+
+    def send(self, message, priority=syslog.LOG_INFO, **fields):
+        if self.rate_limit > 0:
+            now = time.monotonic()
+            self.tokens = min(
+                self.rate_limit, self.tokens + (now - self.refilled) * self.rate_limit / 60)
+            self.refilled = now
+            if self.tokens < 1:
+                self.suppressed += 1
+                return
+            self.tokens -= 1
+
+        if self.journal is not None:
+            fields.update(MESSAGE=message, PRIORITY=priority, SYSLOG_IDENTIFIER="disks-poweroff")
+            data = "".join(
+                f"{name.upper()}={str(value).replace(chr(10), ' ')}\n"
+                for name, value in fields.items())
+            try:
+                self.journal.sendto(data.encode(), self.JOURNAL_SOCKET)
+                return
+            except OSError:
+                pass
+        syslog.syslog(priority, message)
+
+
+class WritebackTuner:
+    """
+    Laptop-mode style writeback coordination. While disk sleeps, its BDI settings
+    (/sys/block/<dev>/bdi/) are raised, so small writes are kept in page cache and flushed in
+    rare bursts. Global vm settings are raised while at least one disk sleeps. Original values
+    are saved before the first change and written back when disk becomes active again.
+    """
+
+    def __init__(self, vm_settings, bdi_settings):
+        self.vm_settings = vm_settings
+        self.bdi_settings = bdi_settings
+        self.saved = {}  # path: original value
+        self.sleeping = set()
+
+    def _set(self, path, value):
+        try:
+            original = read_sysfs(path)
+            write_sysfs(path, value)
+        except OSError as e:
+            syslog.syslog(syslog.LOG_WARNING, f"Can not set {path} to {value}: {e}")
+            return
+        # Keep the value found before our first change
+        self.saved.setdefault(path, original)
+
+    def _restore(self, path):
+        original = self.saved.pop(path, None)
+        if original is None:
+            return
+        try:
+            write_sysfs(path, original)
+        except OSError as e:
+            syslog.syslog(syslog.LOG_ERR, f"Can not restore {path} to {original}: {e}")
+
+    def disk_asleep(self, disk):
+        if disk in self.sleeping:
+            return
+        self.sleeping.add(disk)
+        for name, value in self.bdi_settings.items():
+            self._set(f"/sys/block/{disk}/bdi/{name}", value)
+        if len(self.sleeping) == 1:
+            for name, value in self.vm_settings.items():
+                self._set(f"/proc/sys/vm/{name}", value)
+
+    def disk_awake(self, disk):
+        if disk not in self.sleeping:
+            return
+        self.sleeping.discard(disk)
+        for name in self.bdi_settings:
+            self._restore(f"/sys/block/{disk}/bdi/{name}")
+        if not self.sleeping:
+            for name in self.vm_settings:
+                self._restore(f"/proc/sys/vm/{name}")
+
+    def restore_all(self):
+        for path in list(self.saved):
+            self._restore(path)
+        self.sleeping = set()
+
+
+class RuntimePm:
+    """
+    Kernel-managed spin-down with runtime PM of SCSI disk device: kernel stops disk after
+    autosuspend_delay_ms without I/O and starts it on next I/O, no commands are run by daemon.
+    Original values are saved before the first change and written back on release.
+    """
+
+    def __init__(self):
+        self.saved = {}  # path: original value
+        self.applied = {}  # disk: (control, autosuspend_delay_ms)
+
+    @staticmethod
+    def start_stop_path(disk):
+        device = f"/sys/block/{disk}/device"
+        # Split into system, runtime and shutdown variants in kernel 6.6
+        for name in ("manage_runtime_start_stop", "manage_start_stop"):
+            if os.path.exists(f"{device}/{name}"):
+                return f"{device}/{name}"
+        return None
+
+    def supported(self, disk):
+        return self.start_stop_path(disk) is not None and all(
+            os.path.exists(f"/sys/block/{disk}/device/power/{name}")
+            for name in ("control", "autosuspend_delay_ms", "runtime_status"))
+
+    def _set(self, path, value):
+        original = read_sysfs(path)
+        if original != str(value):
+            write_sysfs(path, value)
+        self.saved.setdefault(path, original)
+
+    def apply(self, disk, timeout, awake):
+        """
+        Sets autosuspend delay to timeout, runtime PM is turned off while disk must stay awake.
+        Returns False if kernel does not support or refuses settings
+        """
+        settings = ("on" if awake else "auto", timeout * 1000)
+        if self.applied.get(disk) == settings:
+            return True
+        if not self.supported(disk):
+            return False
+        power = f"/sys/block/{disk}/device/power"
+        try:
+            self._set(self.start_stop_path(disk), 1)
+            self._set(f"{power}/autosuspend_delay_ms", settings[1])
+            self._set(f"{power}/control", settings[0])
+        except OSError as e:
+            syslog.syslog(syslog.LOG_WARNING, f"Can not set up runtime PM of {disk}: {e}")
+            self.release(disk)
+            return False
+        self.applied[disk] = settings
+        return True
+
+    def status(self, disk):
+        """Returns runtime_status: active, suspended, suspending, resuming or unsupported"""
+        try:
+            return read_sysfs(f"/sys/block/{disk}/device/power/runtime_status")
+        except OSError:
+            return None
+
+    def release(self, disk):
+        """Gives disk back to daemon, restoring settings"""
+        self.applied.pop(disk, None)
+        # Reverse order, so runtime PM is off before start-stop management
+        paths = [path for path in self.saved if path.startswith(f"/sys/block/{disk}/")]
+        for path in reversed(paths):
+            self._restore(path)
+
+    def _restore(self, path):
+        original = self.saved.pop(path)
+        try:
+            write_sysfs(path, original)
+        except OSError as e:
+            syslog.syslog(syslog.LOG_ERR, f"Can not restore {path} to {original}: {e}")
+
+    def restore_all(self):
+        for path in reversed(list(self.saved)):
+            self._restore(path)
+        self.applied = {}
+
+
+def disk_mounts(disk):
+    """Returns mount points of all partitions of disk"""
+    mounts = []
+    with open("/proc/self/mounts", "r") as fd:
+        for line in fd:
+            source, target = line.split(" ")[:2]
+            if re.match(f"/dev/{disk}(p?[0-9]+)?\\Z", source):
+                mounts.append(target.replace("\\040", " "))
+    return mounts
+
+
+def process_files(pid, mounts):
+    """Returns files opened by process, which reside on one of mounts"""
+    files = set()
+    try:
+        fds = os.listdir(f"/proc/{pid}/fd")
+    except OSError:  # process has already exited
+        return []
+    for fd in fds:
+        try:
+            path = os.readlink(f"/proc/{pid}/fd/{fd}")
+        except OSError:
+            continue
+        if any(path == mount or path.startswith(mount.rstrip("/") + "/") for mount in mounts):
+            files.add(path)
+    return sorted(files)
+
+
+def block_disks(name):
+    """Returns whole disks under block device (partition, md, dm) by its kernel name"""
+    path = f"/sys/class/block/{name}"
+    if os.path.exists(os.path.join(path, "partition")):
+        return {os.path.basename(os.path.dirname(os.path.realpath(path)))}
+    try:
+        slaves = os.listdir(os.path.join(path, "slaves"))
+    except OSError:
+        slaves = []
+    if not slaves:
+        return {name}
+    disks = set()
+    for slave in slaves:
+        disks |= block_disks(slave)
+    return disks
+
+
+def md_maintenance():
+    """Returns disks of md arrays running resync, recovery, check, repair or reshape"""
+    disks = set()
+    members = []
+    try:
+        with open("/proc/mdstat", "r") as fd:
+            for line in fd:
+                if re.match("md\\S* : ", line):
+                    members = re.findall("(\\S+)\\[[0-9]+\\]", line)
+                elif re.search("(resync|recovery|check|repair|reshape) *= *[0-9.]+%", line):
+                    for member in members:
+                        disks |= block_disks(member)
+    except OSError:
+        pass
+    return disks
+
+
+def btrfs_scrubs(stale=3600):
+    """
+    Returns disks of btrfs filesystems being scrubbed, from status files of btrfs-progs. Files
+    not updated for stale seconds are left from killed scrubs
+    """
+    disks = set()
+    for path in glob.glob("/var/lib/btrfs/scrub.status.*"):
+        try:
+            if time.time() - os.stat(path).st_mtime > stale:
+                continue
+            with open(path, "r") as fd:
+                lines = fd.readlines()[1:]  # first line is format version
+        except OSError:
+            continue
+        for line in lines:
+            fsid, _, fields = line.strip().partition(":")
+            fields = dict(field.partition(":")[::2] for field in fields.split("|")[1:])
+            if fields.get("finished") == "0" and fields.get("canceled") == "0":
+                with contextlib.suppress(OSError):
+                    for name in os.listdir(f"/sys/fs/btrfs/{fsid}/devices"):
+                        disks |= block_disks(name)
+    return disks
+
+
+def zfs_scrubs():
+    """
+    Returns disks of ZFS pools being scrubbed or resilvered and all disks of pools, zpool reads
+    their labels. None if zpool is not available
+    """
+    try:
+        output = subprocess.run(
+            ["zpool", "status", "-P", "-L"], stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+            universal_newlines=True).stdout
+    except OSError:  # no ZFS
+        return None
+    disks = set()
+    members = set()
+    busy = False
+    for line in output.splitlines():
+        line = line.strip()
+        if line.startswith("pool:"):
+            busy = False
+        elif line.startswith("scan:"):
+            busy = "in progress" in line
+        elif line.startswith("/dev/"):
+            found = block_disks(os.path.basename(line.split()[0]))
+            members |= found
+            if busy:
+                disks |= found
+    return disks, members
+
+
+def self_test_running(data):
+    """Checks smartctl JSON output for ATA self-test in progress, status 0xF?"""
+    status = data.get("ata_smart_data", {}).get("self_test", {}).get("status", {})
+    return status.get("value", 0) >> 4 == 0xF
+
+
+def path_disks(path):
+    """Returns disks holding filesystem mounted at path"""
+    path = os.path.realpath(path)
+    source, target = None, ""
+    with open("/proc/self/mounts", "r") as fd:
+        for line in fd:
+            mount_source, mount_target = line.split(" ")[:2]
+            mount_target = mount_target.replace("\\040", " ")
+            if (
+                    (path == mount_target or path.startswith(mount_target.rstrip("/") + "/"))
+                    and len(mount_target) >= len(target)
+            ):
+                source, target = mount_source, mount_target
+    if source is None or not source.startswith("/dev/"):
+        return set()
+    return block_disks(os.path.basename(os.path.realpath(source)))
+
+
+def slab_object_size(pattern, default):
+    """Returns largest object size of slab caches matching pattern"""
+    sizes = []
+    try:
+        with open("/proc/slabinfo", "r") as fd:
+            for line in fd:
+                fields = line.split()
+                if re.match(pattern, fields[0]):
+                    sizes.append(int(fields[3]))
+    except (OSError, IndexError, ValueError):
+        pass
+    return max(sizes, default=default)
+
+
+class MetadataPinner:
+    """
+    Keeps directory and inode metadata of configured trees warm in dentry and inode caches,
+    so 'ls' and 'find' are served from memory while disks sleep. Trees are walked with lstat
+    periodically while their disks spin and once more right before spin-down. Small files
+    can be locked in memory with mlock.
+    """
+
+    def __init__(self, paths, files, files_max_size):
+        self.trees = {}  # path: disks
+        for path in paths:
+            disks = path_disks(path)
+            if disks:
+                self.trees[path] = disks
+            else:
+                syslog.syslog(syslog.LOG_WARNING, f"Can not find disks for {path}, not pinned")
+        self.walked = {}  # path: time of last walk
+        self.entries = {}  # path: entries in tree
+        # Walks which completed without reading from disk, i.e. wake-ups a sleeping disk
+        # would have had if metadata were not cached
+        self.cached_walks = 0
+        self.entry_size = (
+            slab_object_size("dentry\\Z", 192)
+            + slab_object_size(".*inode(_cache)?\\Z", 1024))
+
+        # Small files are mapped and locked with mlock, so their pages stay in page cache
+        self.pinned = []  # (address, size)
+        libc = ctypes.CDLL(None, use_errno=True)
+        libc.mmap.restype = ctypes.c_void_p
+        libc.mmap.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_int, ctypes.c_int,
+                              ctypes.c_int, ctypes.c_long]
+        libc.mlock.argtypes = libc.munmap.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+        self.libc = libc
+        for pattern in files:
+            for path in glob.glob(pattern.strip(), recursive=True):
+                try:
+                    size = os.path.getsize(path)
+                    if size == 0 or size > files_max_size or not os.path.isfile(path):
+                        continue
+                    with open(path, "rb") as fd:
+                        address = libc.mmap(None, size, mmap.PROT_READ, mmap.MAP_SHARED,
+                                            fd.fileno(), 0)
+                except OSError as e:
+                    syslog.syslog(syslog.LOG_WARNING, f"Can not map {path}: {e}")
+                    continue
+                if address in (None, ctypes.c_void_p(-1).value):
+                    syslog.syslog(syslog.LOG_WARNING,
+                                  f"Can not map {path}: {os.strerror(ctypes.get_errno())}")
+                    continue
+                if libc.mlock(address, size) != 0:
+                    syslog.syslog(syslog.LOG_WARNING,
+                                  f"Can not lock {path}: {os.strerror(ctypes.get_errno())}")
+                    libc.munmap(address, size)
+                    continue
+                self.pinned.append((address, size))
+
+    def walk(self, path):
+        """Stats every entry of tree, returns number of entries"""
+        entries = 0
+        for root, dirs, files in os.walk(path):
+            for name in dirs + files:
+                try:
+                    os.lstat(os.path.join(root, name))
+                except OSError:
+                    continue
+                entries += 1
+        self.walked[path] = time.monotonic()
+        self.entries[path] = entries
+        return entries
+
+    def due(self, awake, interval):
+        """Returns trees which have all disks spinning and were not walked during interval"""
+        return [
+            path for path, disks in self.trees.items()
+            if disks <= awake
+            and time.monotonic() - self.walked.get(path, float("-inf")) >= interval
+        ]
+
+    def trees_of(self, disk):
+        return [path for path, disks in self.trees.items() if disk in disks]
+
+    def memory(self):
+        """Estimated memory used by pinned metadata and locked files, in bytes"""
+        return (
+            sum(self.entries.values()) * self.entry_size
+            + sum(size for _, size in self.pinned))
+
+    def close(self):
+        for address, size in self.pinned:
+            self.libc.munmap(address, size)
+        self.pinned = []
+
+
+class WakeTracer:
+    """
+    Attributes disk wake-ups to processes. While disk sleeps, block_bio_queue tracepoint is
+    enabled for it in private tracefs instance, so requests which woke the disk are recorded
+    with pid and comm of the submitter. Passthrough commands (smartctl, hdparm) do not go
+    through this tracepoint. If tracefs is not available, /proc/<pid>/io deltas are sampled
+    while any disk sleeps, which are not bound to particular disk. trace_pipe is consumed on
+    each collect, entries of disks still sleeping are kept until they are woken.
+    """
+
+    # <...>-1234 [000] d..1. 100.000: block_bio_queue: 8,0 W 1234 + 8 [kworker/u8:1]
+    TRACE_LINE = re.compile(
+        r"^\s*(.*)-(\d+)\s+\[\d+\].*block_bio_queue: (\d+),(\d+) (\S+) \d+ \+ (\d+) \[(.*)\]$")
+
+    def __init__(self, top):
+        self.top = top
+        self.devices = {}  # disk: (major, minor) of sleeping disks
+        self.traced = {}  # (major, minor): Counter of sectors by (comm, pid) read from trace_pipe
+        self.instance = None
+        for root in ("/sys/kernel/tracing", "/sys/kernel/debug/tracing"):
+            if os.path.isdir(os.path.join(root, "instances")):
+                self.instance = os.path.join(root, "instances", "disks-poweroff")
+                break
+        self.io_prev = {}
+        self.io_cur = {}
+
+    def _tracefs(self):
+        """Creates tracefs instance on first use. Falls back to /proc sampling on error"""
+        if self.instance is None or os.path.isdir(self.instance):
+            return self.instance
+        try:
+            os.mkdir(self.instance)
+            write_sysfs(os.path.join(self.instance, "buffer_size_kb"), 64)
+        except OSError as e:
+            syslog.syslog(syslog.LOG_WARNING,
+                          f"Can not create tracefs instance, sampling /proc/<pid>/io: {e}")
+            self.instance = None
+        return self.instance
+
+    def _update_filter(self):
+        instance = self._tracefs()
+        if instance is None:
+            return
+        event = os.path.join(instance, "events", "block", "block_bio_queue")
+        try:
+            if self.devices:
+                # Kernel dev_t encoding: major << 20 | minor
+                write_sysfs(os.path.join(event, "filter"), " || ".join(
+                    f"dev == {major << 20 | minor}" for major, minor in self.devices.values()))
+                write_sysfs(os.path.join(event, "enable"), 1)
+            else:
+                write_sysfs(os.path.join(event, "enable"), 0)
+        except OSError as e:
+            syslog.syslog(syslog.LOG_WARNING, f"Can not configure block tracepoint: {e}")
+
+    def arm(self, disk):
+        """Start recording requests to sleeping disk"""
+        if disk in self.devices:
+            return
+        try:
+            major, minor = read_sysfs(f"/sys/block/{disk}/dev").split(":")
+        except OSError:
+            return
+        self.devices[disk] = (int(major), int(minor))
+        self.traced[self.devices[disk]] = collections.Counter()
+        self._update_filter()
+
+    def sample(self):
+        """Samples per-process I/O counters. Needed only if tracefs is not available"""
+        if self.instance is not None or not self.devices:
+            self.io_prev = self.io_cur = {}
+            return
+        self.io_prev = self.io_cur
+        self.io_cur = {}
+        for path in glob.glob("/proc/[0-9]*/io"):
+            pid = int(path.split("/")[2])
+            try:
+                with open(path, "r") as fd:
+                    counters = dict(line.split(": ") for line in fd.read().splitlines())
+                with open(f"/proc/{pid}/comm", "r") as fd:
+                    comm = fd.read().strip()
+            except (OSError, ValueError):
+                continue
+            self.io_cur[pid] = (
+                comm, int(counters["read_bytes"]) + int(counters["write_bytes"]))
+
+    def _drain(self):
+        """Reads entries queued in trace_pipe without waiting and adds them to sleeping disks"""
+        data = b""
+        fd = os.open(os.path.join(self.instance, "trace_pipe"), os.O_RDONLY | os.O_NONBLOCK)
+        try:
+            while True:
+                try:
+                    chunk = os.read(fd, 65536)
+                except BlockingIOError:
+                    break
+                if not chunk:
+                    break
+                data += chunk
+        finally:
+            os.close(fd)
+        for line in data.decode(errors="replace").splitlines():
+            match = self.TRACE_LINE.match(line)
+            if match is None:
+                continue
+            _, pid, major, minor, _, count, comm = match.groups()
+            sectors = self.traced.get((int(major), int(minor)))
+            if sectors is not None:
+                sectors[(comm, int(pid))] += int(count)
+
+    def collect(self, disk):
+        """
+        Stops recording for woken disk and returns top offenders
+
+        :return: list of (comm, pid, sectors, files)
+        """
+        if disk not in self.devices:
+            return []
+        device = self.devices.pop(disk)
+        mounts = disk_mounts(disk)
+        sectors = collections.Counter()
+        if self.instance is not None:
+            try:
+                self._drain()
+            except OSError as e:
+                syslog.syslog(syslog.LOG_WARNING, f"Can not read block trace: {e}")
+            sectors = self.traced.pop(device, sectors)
+            self._update_filter()
+        else:
+            # 512-byte sectors, same units as tracepoint
+            for pid, (comm, io_bytes) in self.io_cur.items():
+                delta = io_bytes - self.io_prev.get(pid, (comm, io_bytes))[1]
+                if delta > 0:
+                    sectors[(comm, pid)] += delta // 512
+        return [
+            (comm, pid, count, process_files(pid, mounts))
+            for (comm, pid), count in sectors.most_common(self.top)
+        ]
+
+    def close(self):
+        self.devices = {}
+        self.traced = {}
+        if self.instance is not None and os.path.isdir(self.instance):
+            self._update_filter()
+            try:
+                os.rmdir(self.instance)
+            except OSError as e:
+                syslog.syslog(syslog.LOG_WARNING, f"Can not remove tracefs instance: {e}")
 
 
 class DisksPowerOff:
     def __init__(self, configfile):
         """Parse config"""
         syslog.openlog(ident="disks-poweroff", facility=syslog.LOG_DAEMON)
+        self.configfile = configfile
 
-        config = configparser.ConfigParser()
-        config.read(configfile)
+        self.diskstats = {}
+        self.diskstats_prev = {}
+        self.disk_statuses = {}
+        self.stats = {}
+        self.state_changed = False
+        self.suspended = suspended_time()
+        self.reload_requested = False
+        self.schedule_evaluated = float("-inf")
+        self.quiet = {}  # disk: (quiet polls in a row, time of first of them)
+
+        self.writeback = WritebackTuner({}, {})
+        self.runtime_pm = RuntimePm()
+        self.runtime_pm_failed = set()  # disks runtime PM could not be set up for
+        self.wake_tracer = None
+        self.wake_causes = {}
+        self.smart_collected = {}  # disk: time of last collection
+        self.pinner = None
+
+        self.metrics_written = float("-inf")
+        self.metrics_cost = 0.0  # seconds spent on last metrics update
+        self.poll_duration = Histogram()
+        self.polls = 0
+        self.started = time.monotonic()
+
+        # Timings of stages and external commands, dumped on SIGUSR1
+        self.timings = collections.defaultdict(lambda: Histogram(TIMING_BUCKETS))  # (stage, disk)
+        self.overruns = 0  # cycles longer than polling_interval
+
+        self.events = EventLog(None)
+        self.summary_logged = time.monotonic()
+        self.transitions = 0  # since last summary
+        self.history_pending = {}  # disk: Counter of seconds in states not written to history yet
+        self.history_marks = {}  # disk: time up to which its state is written to history
+        self.history_flushed = time.monotonic()
+        self.history_compacted = float("-inf")
+
+        self.selector = None
+        self.holds = {}  # disk: time until disk is kept awake, None if indefinitely
+        self.maintenance = {}  # disk: kinds of maintenance running on it
+        self.scrubs = set()  # disks of btrfs and ZFS scrubs, checked less often
+        self.scrubs_checked = float("-inf")
+        self.self_tests = set()  # disks running SMART self-test
+        self.coaccess = None
+        self.coaccess_saved = time.monotonic()
+        self.predictions = {}  # disk: (time of predicted wake, deadline of use)
+        self.predicted_reads = collections.deque()  # disks whose predicted wake read completed
+
+        self.protocols = {protocol: backend() for protocol, backend in BACKENDS.items()}
+        self.backends = {}  # disk: backend of its protocol
+        self.capability_cache = None  # drive identity: capabilities, loaded once
+        self.capabilities = {}  # disk: capabilities of drive
+        self.identities = {}  # disk: drive identity
+
+        self.load_config(read_config(self.configfile))
+
+    def load_config(self, config):
+        """
+        Applies parsed config. On reload, disks are added and removed, settings are updated,
+        states and timers of remaining disks are kept. Invalid values are replaced by defaults,
+        so config is never applied partially
+        """
+        section = config["disks-poweroff"]
 
         # Find all physical disks
-        possible_devices = [dev for dev in os.listdir('/dev') if re.match("[sh]d[a-z]\Z", dev)]
+        possible_devices = [dev for dev in os.listdir('/dev') if re.match(DISK_PATTERN, dev)]
         # Read disks from config. If none passed, use all
         try:
-            disks = config["disks-poweroff"]["devices"].strip().split(",")
+            disks = section["devices"].strip().split(",")
         except KeyError:
             disks = possible_devices
+            self.configured_disks = None
             syslog.syslog(syslog.LOG_WARNING,
                           "Missing 'devices' section in config. Using all possible devices")
 
@@ -71,120 +1681,1678 @@ class DisksPowerOff:
             return disk
 
         disks = [normalize_disk(disk) for disk in disks]
-        self.disks = [disk for disk in disks if disk in possible_devices]
+        if "devices" in section:
+            self.configured_disks = set(disks)
+            ignored = sorted(disk for disk in disks if re.match(DISK_PATTERN, disk) is None)
+            if ignored:
+                syslog.syslog(syslog.LOG_WARNING,
+                              f"Can not monitor {', '.join(ignored)}: not a whole disk, ignored")
+        self.update_disks([disk for disk in disks if disk in possible_devices])
 
         syslog.syslog(syslog.LOG_INFO, f"Working with disks: {', '.join(self.disks)}")
 
-        # If the disk is idle during timeout, we will turn it off
-        timeout = config["disks-poweroff"].get("timeout", "1800")  # defaulting to 30 min
-        try:
-            self.timeout = int(timeout)
-        except ValueError:
-            syslog.syslog(
-                syslog.LOG_WARNING,
-                "Invalid config record for 'timeout', setting default value 1800 seconds")
-            self.timeout = 1800
+        # If the disk is idle during timeout, we will turn it off. Defaulting to 30 min, accepts
+        # suffixes like [disk:] and [group:] sections
+        self.timeout = config_option(section, "timeout", 1800, parse_seconds, minimum=0)
 
         # Polling interval in seconds
-        polling_interval = config["disks-poweroff"].get("polling_interval", "5")  # 5 seconds
+        self.polling_interval = config_option(
+            section, "polling_interval", 5, parse_seconds, minimum=1)
+
+        default = default_policy(section, self.timeout)
+        # Per-disk overrides from [model:<glob>], [group:<name>] and [disk:<id>] sections
+        self.groups = {}
+        self.base_policies = compile_policies(config, self.disks, default, self.groups)
+        # Capabilities of drives probed earlier, by drive identity
+        self.capabilities_file = section.get(
+            "capabilities_file", "/var/lib/disks-poweroff/capabilities.json")
+        self.capability_probe = section.get("capability_probe", "passive")
+        self.load_capabilities()
+        self.backends = {disk: self.select_backend(disk) for disk in self.disks}
+
+        # Spin-up time measured by profile command replaces configured spinup_seconds
+        profiles_file = section.get(
+            "profiles_file", "/var/lib/disks-poweroff/profiles.json")
+        profiles = read_json(profiles_file, {})
+        for disk, policy in self.base_policies.items():
+            measured = profiled_spinup(profiles, self.identities[disk], policy.tier)
+            if measured is not None:
+                policy.spinup_seconds = measured
+
+        # Spin-downs, wake-ups and periodic totals of time in states are appended here for
+        # 'disks-poweroff.py report'. Records older than history_keep are dropped once a day
+        self.history_file = section.get(
+            "history_file", "/var/lib/disks-poweroff/history.jsonl")
+        self.history_interval = config_option(
+            section, "history_interval", 3600, parse_seconds, minimum=60)
+        self.history_keep = config_option(
+            section, "history_keep", 400 * 86400, parse_seconds, minimum=86400)
+
+        # Time-of-day schedules, referenced by 'schedule' setting of disks
+        self.schedules = {
+            section[len("schedule:"):]: Schedule(section[len("schedule:"):], config[section])
+            for section in config.sections() if section.startswith("schedule:")
+        }
+        for disk, policy in self.base_policies.items():
+            if policy.schedule is not None and policy.schedule not in self.schedules:
+                syslog.syslog(syslog.LOG_WARNING,
+                              f"Unknown schedule '{policy.schedule}' for {disk}, ignored")
+                policy.schedule = None
+        self.schedule_next = float("-inf")  # force evaluation
+        self.apply_schedules()
+        # Disks dropped from runtime PM are managed by daemon again, failed ones are retried
+        for disk in list(self.runtime_pm.applied):
+            if disk not in self.base_policies or not self.base_policies[disk].runtime_pm:
+                self.runtime_pm.release(disk)
+        self.runtime_pm_failed = set()
+
+        # Writeback settings applied while disks sleep. Settings missing in config are not touched
+        vm_settings = {}
+        bdi_settings = {}
+        if config_option(section, "writeback_tuning", False, parse_bool):
+            for name in ("dirty_expire_centisecs", "dirty_writeback_centisecs", "laptop_mode"):
+                if name in section:
+                    vm_settings[name] = section[name]
+            for name in ("min_ratio", "max_ratio"):
+                if f"bdi_{name}" in section:
+                    bdi_settings[name] = section[f"bdi_{name}"]
+        if (vm_settings, bdi_settings) != (self.writeback.vm_settings, self.writeback.bdi_settings):
+            self.writeback.restore_all()
+            self.writeback = WritebackTuner(vm_settings, bdi_settings)
+            for disk in self.sleeping_disks():
+                self.writeback.disk_asleep(disk)
+
+        # Log processes which woke disks up
+        wake_attribution = config_option(section, "wake_attribution", False, parse_bool)
+        wake_attribution_top = config_option(section, "wake_attribution_top", 5, minimum=1)
+        if self.wake_tracer is not None and not wake_attribution:
+            self.wake_tracer.close()
+            self.wake_tracer = None
+        elif self.wake_tracer is None and wake_attribution:
+            self.wake_tracer = WakeTracer(wake_attribution_top)
+            for disk in self.sleeping_disks():
+                self.wake_tracer.arm(disk)
+        if self.wake_tracer is not None:
+            self.wake_tracer.top = wake_attribution_top
+        self.wake_causes_file = section.get(
+            "wake_causes_file", "/run/disks-poweroff/wake-causes.json")
+
+        # Anti-thrash: wake-up within thrash_window after spin-down multiplies timeout of disk by
+        # thrash_factor, up to thrash_max_factor. Multiplier decays back with half-life thrash_decay
+        self.thrash_window = config_option(
+            section, "thrash_window", 300, parse_duration, minimum=0)
+        self.thrash_factor = config_option(section, "thrash_factor", 2.0, float, minimum=1)
+        self.thrash_max_factor = config_option(
+            section, "thrash_max_factor", 16.0, float, minimum=1)
+        self.thrash_decay = config_option(
+            section, "thrash_decay", 86400, parse_duration, minimum=0)
+
+        # Co-access graph: disks becoming active within coaccess_window seconds of each other are
+        # linked, weights decay with half-life coaccess_decay. With predictive_wake, partners
+        # co-accessed in at least predictive_threshold share of wake-ups are woken in parallel
+        coaccess_window = config_option(
+            section, "coaccess_window", 30, parse_duration, minimum=0)
+        coaccess_decay = config_option(
+            section, "coaccess_decay", 7 * 86400, parse_duration, minimum=0)
+        self.coaccess_file = section.get(
+            "coaccess_file", "/var/lib/disks-poweroff/coaccess.json")
+        if coaccess_window <= 0:
+            self.coaccess = None
+        elif self.coaccess is None:
+            self.coaccess = CoAccessGraph(coaccess_window, coaccess_decay)
+            self.coaccess.from_dict(read_json(self.coaccess_file, {}))
+        else:
+            self.coaccess.window, self.coaccess.half_life = coaccess_window, coaccess_decay
+        self.predictive_wake = config_option(section, "predictive_wake", False, parse_bool)
+        self.predictive_threshold = config_option(
+            section, "predictive_threshold", 0.6, float, minimum=0)
+
+        # Keep disks awake during md resync or check, btrfs or ZFS scrub and SMART self-test.
+        # /proc/mdstat is read every poll, scrubs are checked every maintenance_interval
+        self.maintenance_aware = config_option(section, "maintenance_aware", True, parse_bool)
+        self.maintenance_interval = config_option(
+            section, "maintenance_interval", 300, parse_seconds, minimum=1)
+
+        # Cache SMART data while disks are spinning, so monitoring never has to wake them
+        self.smart_cache = config_option(section, "smart_cache", False, parse_bool)
+        self.smart_cache_dir = section.get(
+            "smart_cache_dir", "/run/disks-poweroff/smart")
+        self.smart_cache_interval = config_option(
+            section, "smart_cache_interval", 600, parse_seconds, minimum=1)
+
+        # Keep metadata of directory trees in memory
+        self.pin_interval = config_option(
+            section, "pin_interval", 600, parse_seconds, minimum=1)
+        pin_paths = [
+            path.strip() for path in section.get("pin_metadata", "").split(",")
+            if path.strip()]
+        pin_files = [
+            path.strip() for path in section.get("pin_files", "").split(",")
+            if path.strip()]
+        pin_files_max_size = config_option(
+            section, "pin_files_max_size", 1048576, minimum=0)
+        pin_config = (pin_paths, pin_files, pin_files_max_size)
+        if pin_config != getattr(self, "pin_config", ([], [], None)):
+            if self.pinner is not None:
+                self.pinner.close()
+                self.pinner = None
+            if pin_paths or pin_files:
+                self.pinner = MetadataPinner(*pin_config)
+        self.pin_config = pin_config
+
+        # Prometheus metrics for node_exporter textfile collector
+        self.metrics_textfile = section.get("metrics_textfile", "")
+        self.metrics_interval = config_option(
+            section, "metrics_interval", 60, parse_seconds, minimum=1)
+
+        # Stage timings are dumped to this file on SIGUSR1
+        self.timings_file = section.get("timings_file", "")
+
+        # Every state transition is logged as event. Summary of all disks is logged periodically
+        event_rate_limit = config_option(section, "event_rate_limit", 60, minimum=0)
+        if event_rate_limit != self.events.rate_limit:
+            self.events = EventLog(event_rate_limit)
+        self.summary_interval = config_option(
+            section, "summary_interval", 3600, parse_seconds, minimum=0)
+
+        # Control socket for disks-poweroff ctl, not changed on reload
+        if self.selector is None:
+            self.control_socket = section.get(
+                "control_socket", "/run/disks-poweroff/control.sock")
+
+        # Disk states are saved here and restored after daemon restart
+        self.state_file = section.get(
+            "state_file", "/run/disks-poweroff/state.json")
+
+    def apply_schedules(self):
+        """
+        Builds effective policies from base policies and schedules. Runs only at precomputed
+        transition points, or if wall clock went backwards
+        """
+        now = time.time()
+        if self.schedule_evaluated <= now < self.schedule_next:
+            return
+        local = time.localtime(now)
+        minute = local.tm_wday * 24 * 60 + local.tm_hour * 60 + local.tm_min
+        policies = {}
+        next_point = minute + WEEK
+        for disk, base in self.base_policies.items():
+            policy = base
+            if base.schedule is not None:
+                overrides, point = self.schedules[base.schedule].at(minute)
+                next_point = min(next_point, point)
+                if overrides:
+                    policy = base.copy()
+                    for name, value in overrides.items():
+                        setattr(policy, name, value)
+            policies[disk] = policy
+        self.policies = policies
+        self.schedule_evaluated = now
+        # Local time of the point, so it is not shifted by DST change before it
+        self.schedule_next = time.mktime((
+            local.tm_year, local.tm_mon, local.tm_mday - local.tm_wday + next_point // (24 * 60),
+            next_point % (24 * 60) // 60, next_point % 60, 0, 0, 0, -1))
+
+    def update_disks(self, disks):
+        """Sets monitored disks. Removed disks are forgotten, added disks start with no state"""
+        for disk in set(getattr(self, "disks", [])) - set(disks):
+            if self.disk_statuses.get(disk, [None])[0] == "POWEROFF":
+                self.writeback.disk_awake(disk)
+                if self.wake_tracer is not None:
+                    self.wake_tracer.collect(disk)
+            for table in (self.disk_statuses, self.stats, self.diskstats, self.diskstats_prev,
+                          self.holds, self.smart_collected, self.wake_causes, self.quiet,
+                          self.capabilities, self.identities, self.maintenance,
+                          self.predictions, self.history_pending, self.history_marks):
+                table.pop(disk, None)
+            self.self_tests.discard(disk)
+        for disk in disks:
+            if disk not in self.stats:
+                self.stats[disk] = DiskStats()
+        self.disks = disks
+
+    def sleeping_disks(self):
+        return [disk for disk, status in self.disk_statuses.items() if status[0] == "POWEROFF"]
+
+    def reload(self):
+        """
+        Rereads config, keeping states and timers of disks. Unreadable config leaves previous one
+        in effect
+
+        :return: error message or None
+        """
+        self.reload_requested = False
         try:
-            self.polling_interval = int(polling_interval)
-        except ValueError:
-            syslog.syslog(
-                syslog.LOG_WARNING,
-                "Invalid config record for 'polling_interval', setting default value 5 seconds")
-            self.polling_interval = 5
+            config = read_config(self.configfile)
+        except configparser.Error as e:
+            syslog.syslog(syslog.LOG_ERR, f"Can not reload config, keeping previous one: {e}")
+            return f"Can not reload config: {e}"
+        old_disks = set(self.disks)
+        self.load_config(config)
+        added = sorted(set(self.disks) - old_disks)
+        removed = sorted(old_disks - set(self.disks))
+        syslog.syslog(
+            syslog.LOG_INFO,
+            f"Config reloaded: timeout {self.timeout}, polling_interval {self.polling_interval}"
+            + (f", added disks: {', '.join(added)}" if added else "")
+            + (f", removed disks: {', '.join(removed)}" if removed else ""))
+        if added:
+            self.probe_capabilities(added)
+            self.probe_power_modes("of added disks", added)
+            # Only added disks get baseline, activity of others since last poll is kept
+            for disk in added:
+                self.repoll(disk)
 
-        self.diskstats = {}
-        self.diskstats_prev = {}
-        self.disk_statuses = {}
-        self.dump_log = False
+    def wanted(self, disk):
+        """
+        Checks if disk is to be monitored when present. Same filter as load_config, so disks it
+        would drop do not trigger reload every poll
+        """
+        if re.match(DISK_PATTERN, disk) is None:
+            return False
+        return self.configured_disks is None or disk in self.configured_disks
+
+    def request_reload(self, signum, frame):
+        """SIGHUP handler, config is reloaded before next polling cycle"""
+        self.reload_requested = True
+
+    def repoll(self, disk):
+        """
+        Rereads stats of single disk. Some disks (e.g. Samsung 850 EVO) increase read and
+        written sectors after smartctl call, this should not be treated as activity
+        """
+        with open("/proc/diskstats", "r") as fd:
+            for line in fd.readlines():
+                name, counters = parse_diskstats_line(line)
+                if name == disk:
+                    self.diskstats[disk] = counters
 
     def poll(self):
         """Checks if any bytes were read of written to disk"""
         self.diskstats_prev = copy.deepcopy(self.diskstats)
         self.diskstats = {}
+        # Reads of predictive wakes completed by now are in diskstats read below, they are not
+        # activity: one 4096 bytes read
+        while self.predicted_reads:
+            disk = self.predicted_reads.popleft()
+            if disk in self.diskstats_prev:
+                self.diskstats_prev[disk][0] += 1
+                self.diskstats_prev[disk][1] += 8
 
+        present = set()
         with open("/proc/diskstats", "r") as fd:
             for line in fd.readlines():
-                disk, sectors_read, sectors_written = parse_diskstats_line(line)
+                disk, counters = parse_diskstats_line(line)
+                present.add(disk)
                 if disk in self.disks:
-                    self.diskstats[disk] = [sectors_read, sectors_written]
+                    self.diskstats[disk] = counters
+
+        # Disks plugged in or removed are picked up by config reload, which probes new ones
+        wanted = {
+            disk for disk in present if self.wanted(disk) and os.path.exists(f"/dev/{disk}")}
+        if wanted != set(self.disks) and not self.reload_requested:
+            syslog.syslog(syslog.LOG_INFO, "Disks were plugged in or removed, reloading config")
+            self.reload_requested = True
+
+        if self.wake_tracer is not None:
+            self.wake_tracer.sample()
+
+    def active(self, disk):
+        """Checks if disk activity since previous poll reaches thresholds of its policy"""
+        previous = self.diskstats_prev.get(disk)
+        current = self.diskstats.get(disk)
+        if previous is None or current is None:
+            return True
+        policy = self.policies[disk]
+        reads, sectors_read, writes, sectors_written, discards, flushes = (
+            cur - prev for cur, prev in zip(current, previous))
+        if not policy.ignore_discard_flush and (discards or flushes):
+            return True
+        # Thresholds set to 0 are disabled
+        return any(threshold and value >= threshold for value, threshold in (
+            (sectors_read, policy.read_sectors),
+            (reads, policy.read_ops),
+            (sectors_written, policy.write_sectors),
+            (writes, policy.write_ops),
+        ))
 
     def compare(self):
         """Compare disk stats"""
         for disk in self.disks:
-            # state (sectors written or sectors read) not changed and not empty
-            if (
-                    (self.diskstats_prev.get(disk, []) == self.diskstats.get(disk, []))
-                    and (self.diskstats.get(disk, []) != [])
-            ):
+            self.check_prediction(disk)
+            if not self.active(disk):
                 # disk not in idle or poweroff state
                 if (
                         (self.disk_statuses.get(disk, [None, None])[0] != "IDLE")
                         and (self.disk_statuses.get(disk, [None, None])[0] != "POWEROFF")
                 ):
-                    # it's time to change status and write line to log
-                    self.dump_log = True
-                    self.disk_statuses[disk] = ["IDLE", time.time()]
+                    # Disk becomes idle after quiet_samples quiet polls in a row, idle timer
+                    # starts from the first of them
+                    count, since = self.quiet.get(disk, (0, time.monotonic()))
+                    self.quiet[disk] = (count + 1, since)
+                    if count + 1 >= self.policies[disk].quiet_samples:
+                        # it's time to change status and write line to log
+                        self.set_state(disk, "IDLE", since, cause="no I/O")
             else:
-                # state changed
-                if self.disk_statuses.get(disk, [None, None])[0] != "ACTIVE":
-                    # if disk was not active, write info to log
-                    self.dump_log = True
-                # even if disk was in active state, update timer
-                self.disk_statuses[disk] = ["ACTIVE", time.time()]
+                # state changed, even if disk was in active state, update timer
+                self.quiet.pop(disk, None)
+                self.set_state(disk, "ACTIVE", cause="I/O")
 
     def poweroff(self):
         for disk in self.disks:
-            disk_status = self.disk_statuses.get(disk, ["ACTIVE", time.time()])
+            if self.kernel_managed(disk):
+                continue
+            if self.held(disk) or self.policies[disk].nosleep:
+                continue
+            disk_status = self.disk_statuses.get(disk, ["ACTIVE", time.monotonic()])
             if (
                     ((disk_status[0] == "IDLE") or (disk_status[0] == "POWEROFF"))
-                    and (time.time() - disk_status[1] >= self.timeout)
+                    and (time.monotonic() - disk_status[1] >= self.effective_timeout(disk))
             ):
+                if disk_status[0] == "IDLE":
+                    # Held from next poll, idle timer restarts when test ends
+                    if self.maintenance_aware and self.check_self_test(disk):
+                        continue
+                    self.pin_before_poweroff(disk)
+
                 # Recheck if disk is sleeping every time
-                smartctl = subprocess.Popen(
-                    ["smartctl", "-n", "standby", f"/dev/{disk}"],
-                    stdout=subprocess.DEVNULL,
-                    stderr=subprocess.STDOUT)
-                smartctl.communicate()
-
-                if smartctl.returncode != 2:  # sleeping
-                    # WARNING: also returncode == 2 if smartctl failed
-                    hdparm = subprocess.Popen(
-                        ["hdparm", "-yY", f"/dev/{disk}"],
-                        stdout=subprocess.DEVNULL,
-                        stderr=subprocess.STDOUT)
-                    hdparm.communicate()
-
-                    if hdparm.returncode != 0:
-                        syslog.syslog(syslog.LOG_ERR, f"hdparm failed for {disk}")
-
-                if self.disk_statuses[disk][0] != "POWEROFF":
-                    self.dump_log = True
-                self.disk_statuses[disk][0] = "POWEROFF"
+                with self.timed("poweroff", disk):
+                    self.spin_down(disk)
+
+                # Timer is kept, disk is rechecked every poll
+                self.set_state(disk, "POWEROFF", disk_status[1], cause="timeout")
 
                 # It is needed to repoll some disks here, because read sectors and written sectors
                 # values increase after smartctl or hdparm call. My Samsung 850 EVO needs this
 
-    def run(self):
+    def kernel_managed(self, disk):
+        """
+        Hands disk over to kernel runtime PM if its policy asks for it, and follows
+        runtime_status. Returns False if disk is left to poweroff flow
+        """
+        policy = self.policies[disk]
+        if not policy.runtime_pm or disk in self.runtime_pm_failed:
+            return False
+        awake = self.held(disk) or policy.nosleep
+        status = None
+        if self.runtime_pm.apply(disk, self.effective_timeout(disk), awake):
+            status = self.runtime_pm.status(disk)
+        if status in (None, "unsupported"):
+            syslog.syslog(syslog.LOG_WARNING,
+                          f"Runtime PM is not available for {disk}, using {policy.tier} tier")
+            self.runtime_pm.release(disk)
+            self.runtime_pm_failed.add(disk)
+            return False
+        disk_status = self.disk_statuses.get(disk, [None, None])
+        if status == "suspended" and disk_status[0] != "POWEROFF":
+            self.stats[disk].spindowns += 1
+            self.set_state(disk, "POWEROFF", disk_status[1], cause="runtime PM")
+        return True
+
+    def spin_down(self, disk):
+        """Stops disk, unless it is already in power mode of its tier"""
+        backend = self.backends[disk]
+        capabilities = self.capabilities.get(disk, {})
+        if self.mode_checkable(disk):
+            mode = self.check_power_modes([disk])[disk]
+        else:
+            # Mode can not be read without side effects, disk is stopped once per idle period
+            mode = "STANDBY" if self.disk_statuses.get(disk, [None])[0] == "POWEROFF" else "ACTIVE"
+        if mode == "ACTIVE":
+            started = time.monotonic()
+            stopped = backend.stop(disk, self.policies[disk].tier)
+            self.account(disk, backend.stop_command, time.monotonic() - started, stopped)
+            if not stopped:
+                syslog.syslog(syslog.LOG_ERR, f"{backend.stop_command} failed for {disk}")
+            else:
+                self.stats[disk].spindowns += 1
+                if capabilities.get("standby_honored") is None and self.mode_checkable(disk):
+                    # Learned once per drive: some drives ignore standby command
+                    honored = self.check_power_modes([disk])[disk]
+                    if honored is not None:
+                        self.update_capabilities(disk, standby_honored=honored == "STANDBY")
+        elif mode is None:
+            syslog.syslog(syslog.LOG_ERR, f"{backend.check_command} failed for {disk}")
+
+    def held(self, disk):
+        """Checks if disk is kept awake. Idle timer restarts when hold expires"""
+        if disk in self.maintenance:
+            return True
+        if disk not in self.holds:
+            return False
+        until = self.holds[disk]
+        if until is None or time.monotonic() < until:
+            return True
+        del self.holds[disk]
+        if disk in self.disk_statuses:
+            self.disk_statuses[disk][1] = time.monotonic()
+        return False
+
+    def check_maintenance(self):
+        """Holds disks awake while maintenance runs on them, idle timers restart when it ends"""
+        if not self.maintenance_aware:
+            found = {}
+        else:
+            found = collections.defaultdict(set)
+            for disk in md_maintenance():
+                found[disk].add("md")
+            for disk in self.scrubs:
+                found[disk].add("scrub")
+            for disk in self.self_tests:
+                found[disk].add("self-test")
+        maintenance = {disk: found[disk] for disk in self.disks if disk in found}
+        for disk in self.disks:
+            kinds = maintenance.get(disk, set())
+            running = self.maintenance.get(disk, set())
+            if kinds - running:
+                self.events.send(
+                    f"{disk}: maintenance started ({', '.join(sorted(kinds - running))})",
+                    disk=disk, maintenance=",".join(sorted(kinds)))
+            elif running and not kinds:
+                self.events.send(f"{disk}: maintenance finished ({', '.join(sorted(running))})",
+                                 disk=disk, maintenance="")
+                if disk in self.disk_statuses:
+                    self.disk_statuses[disk][1] = time.monotonic()
+        self.maintenance = maintenance
+
+    def check_scrubs(self):
+        """
+        Finds btrfs and ZFS scrubs and rechecks running self-tests every maintenance_interval.
+        Runs after compare, so reads of pool labels by zpool are dropped by repolling pool disks
+        right after it
+        """
+        if not self.maintenance_aware:
+            return
+        if time.monotonic() - self.scrubs_checked < self.maintenance_interval:
+            return
+        self.scrubs_checked = time.monotonic()
+        scrubs = btrfs_scrubs()
+        with self.timed("zpool"):
+            zfs = zfs_scrubs()
+        if zfs is not None:
+            scrubbing, members = zfs
+            scrubs |= scrubbing
+            for disk in members & set(self.disks):
+                self.repoll(disk)
+        self.scrubs = scrubs
+        for disk in list(self.self_tests):
+            self.check_self_test(disk)
+
+    def check_self_test(self, disk):
+        """
+        Asks ATA drive if SMART self-test runs. Self-test does no block I/O, so disk would look
+        idle. Returns True if test runs, disk is then held awake as maintenance
+        """
+        if not isinstance(self.backends[disk], (AtaBackend, SatBackend)):
+            return False
+        # -n standby: never wake the disk. -c: capabilities with self-test status
+        started = time.monotonic()
+        smartctl = subprocess.Popen(
+            ["smartctl", "-n", "standby", "-j", "-c", f"/dev/{disk}"],
+            stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, universal_newlines=True)
+        output, _ = smartctl.communicate()
+        self.account(disk, "smartctl", time.monotonic() - started, not smartctl.returncode & 0b11)
+        self.repoll(disk)
+        try:
+            running = not smartctl.returncode & 0b11 and self_test_running(json.loads(output))
+        except ValueError:
+            running = False
+        if running:
+            self.self_tests.add(disk)
+        else:
+            self.self_tests.discard(disk)
+        return running
+
+    def set_state(self, disk, state, since=None, cause=""):
+        """Changes disk state and restarts its timer, unless since is passed"""
+        now = time.monotonic()
+        old_state, old_since = self.disk_statuses.get(disk, [None, None])
+        self.disk_statuses[disk] = [state, now if since is None else since]
+        if state == "ACTIVE":
+            # Quiet polls before wake-up without I/O (control, prediction) do not count
+            self.quiet.pop(disk, None)
+        if old_state == state:
+            return
+        self.state_changed = True
+        self.transitions += 1
+
+        idle_seconds = 0
+        if old_state in ("IDLE", "POWEROFF"):
+            idle_seconds = int(now - old_since)
+        self.events.send(
+            f"{disk}: {old_state or 'UNKNOWN'} -> {state}"
+            + (f" after {idle_seconds} seconds idle" if idle_seconds else "")
+            + (f" ({cause})" if cause else ""),
+            disk=disk, old_state=old_state or "UNKNOWN", new_state=state,
+            idle_seconds=idle_seconds, cause=cause)
+
+        stats = self.stats[disk]
+        in_state = now - stats.entered
+        if old_state is not None:
+            self.record_history(disk, old_state, state, in_state)
+            stats.seconds[old_state] += in_state
+            if (
+                    (old_state == "ACTIVE") and stats.woken
+                    and (now - stats.entered <= self.polling_interval)
+            ):
+                stats.false_wakes += 1
+        stats.entered = now
+        stats.woken = False
+
+        if state == "POWEROFF":
+            stats.spun_down_by = cause
+            self.writeback.disk_asleep(disk)
+            if self.wake_tracer is not None:
+                self.wake_tracer.arm(disk)
+        else:
+            self.writeback.disk_awake(disk)
+        if old_state == "POWEROFF" and state == "ACTIVE":
+            stats.wakeups += 1
+            stats.woken = True
+            self.attribute_wake(disk)
+            # Only I/O after spin-down issued by daemon or kernel is thrashing. Wakes by control,
+            # hold or prediction (a miss is counted instead) and disks found stopped at startup
+            # or resume do not back timeout off
+            if (
+                    in_state < self.thrash_window and cause == "I/O"
+                    and stats.spun_down_by in ("timeout", "runtime PM")
+            ):
+                self.thrash(disk, in_state)
+        if state == "ACTIVE" and cause == "I/O" and self.coaccess is not None:
+            self.learn_coaccess(disk, old_state)
+
+    def check_prediction(self, disk):
+        """Counts predictive wake of disk as hit if disk is used before deadline, else as miss"""
+        if disk not in self.predictions:
+            return
+        woken, deadline = self.predictions[disk]
+        stats = self.stats[disk]
+        now = time.monotonic()
+        if self.active(disk):
+            stats.prediction_hits += 1
+            # Users waited only for the rest of spin-up
+            stats.prediction_saved_seconds += min(now - woken, self.policies[disk].spinup_seconds)
+            del self.predictions[disk]
+            # Use of predicted disk does not wake it up, so it is learned here
+            if self.coaccess is not None:
+                self.coaccess.activated(self.identities.get(disk, disk), time.time())
+        elif now >= deadline:
+            stats.prediction_misses += 1
+            del self.predictions[disk]
+
+    def learn_coaccess(self, disk, old_state):
+        """Feeds activation of disk to co-access graph and wakes its likely partners"""
+        now = time.time()
+        drive = self.identities.get(disk, disk)
+        self.coaccess.activated(drive, now)
+        if not self.predictive_wake or old_state != "POWEROFF":
+            return
+        drives = {self.identities.get(other, other): other for other in self.disks}
+        for partner in self.coaccess.partners(drive, self.predictive_threshold, now):
+            other = drives.get(partner)
+            if other is None or self.disk_statuses.get(other, [None])[0] != "POWEROFF":
+                continue
+            thread = threading.Thread(target=self.predicted_wake, args=(other,), daemon=True)
+            thread.start()
+            self.stats[other].predicted_wakes += 1
+            self.predictions[other] = (
+                time.monotonic(),
+                time.monotonic() + self.coaccess.window + self.policies[other].spinup_seconds)
+            self.set_state(other, "ACTIVE", cause=f"predicted from {disk}")
+
+    def predicted_wake(self, disk):
+        """Spins disk up, runs in its own thread so partners spin up in parallel"""
+        try:
+            wake_disk(disk)
+        except OSError as e:
+            syslog.syslog(syslog.LOG_WARNING, f"Can not wake {disk} up: {e}")
+            return
+        self.predicted_reads.append(disk)
+
+    def backoff(self, disk):
+        """Returns current timeout multiplier of disk, decayed since last change"""
+        stats = self.stats[disk]
+        elapsed = time.monotonic() - stats.backoff_changed
+        return 1 + (stats.backoff - 1) * 0.5 ** (elapsed / max(self.thrash_decay, 1))
+
+    def effective_timeout(self, disk):
+        """Timeout of disk policy, multiplied by anti-thrash backoff"""
+        return int(self.policies[disk].timeout * self.backoff(disk))
+
+    def thrash(self, disk, slept):
+        """Counts wake-up soon after spin-down and backs timeout of disk off"""
+        stats = self.stats[disk]
+        stats.thrashes += 1
+        stats.backoff = min(self.backoff(disk) * self.thrash_factor, self.thrash_max_factor)
+        stats.backoff_changed = time.monotonic()
+        self.events.send(
+            f"{disk}: woken {int(slept)} seconds after spin-down, "
+            f"timeout backed off to {self.effective_timeout(disk)} seconds",
+            disk=disk, thrashes=stats.thrashes)
+
+    def record_history(self, disk, old_state, state, seconds):
+        """
+        Adds time spent in old state to history. Only transitions into and out of POWEROFF are
+        written right away, time of ACTIVE and IDLE periods is written with them or periodically
+        """
+        self.account_history(disk, old_state, seconds)
+        if "POWEROFF" in (old_state, state):
+            record = self.history_record(disk)
+            record.update({"from": old_state, "to": state})
+            self.write_history([record])
+
+    def account_history(self, disk, state, seconds):
+        """Adds seconds of state ending now to pending history of disk"""
+        now = time.monotonic()
+        # Part of the state written by periodic flush does not count again
+        seconds = min(seconds, now - self.history_marks.get(disk, float("-inf")))
+        self.history_marks[disk] = now
+        self.history_pending.setdefault(disk, collections.Counter())[state] += seconds
+
+    def history_record(self, disk):
+        """Takes pending seconds in states of disk to history record"""
+        pending = self.history_pending.pop(disk, {})
+        return {"time": round(time.time()), "disk": disk, "drive": self.identities.get(disk),
+                "states": {state: round(seconds, 1) for state, seconds in pending.items()}}
+
+    def flush_history(self, force=False):
+        """
+        Writes time disks spent in their states since last record, every history_interval unless
+        forced. Compacts history once a day
+        """
+        if not self.history_file:
+            return
+        now = time.monotonic()
+        if not force and now - self.history_flushed < self.history_interval:
+            return
+        self.history_flushed = now
+        records = []
+        for disk in self.disks:
+            state = self.disk_statuses.get(disk, [None])[0]
+            if state is None:
+                continue
+            self.account_history(disk, state, now - self.stats[disk].entered)
+            records.append(self.history_record(disk))
+        self.write_history(records)
+        if now - self.history_compacted >= 86400:
+            self.history_compacted = now
+            self.compact_history()
+
+    def write_history(self, records):
+        if not records or not self.history_file:
+            return
+        try:
+            os.makedirs(os.path.dirname(self.history_file), exist_ok=True)
+            with open(self.history_file, "a") as fd:
+                fd.writelines(json.dumps(record) + "\n" for record in records)
+        except OSError as e:
+            syslog.syslog(syslog.LOG_WARNING, f"Can not write history to {self.history_file}: {e}")
+
+    def compact_history(self):
+        """Drops history records older than history_keep"""
+        oldest = time.time() - self.history_keep
+        try:
+            with open(self.history_file, "r") as fd:
+                lines = fd.readlines()
+            kept = []
+            for line in lines:
+                try:
+                    if json.loads(line)["time"] >= oldest:
+                        kept.append(line)
+                except (ValueError, KeyError, TypeError):
+                    continue
+            if len(kept) == len(lines):
+                return
+            with open(self.history_file + ".tmp", "w") as fd:
+                fd.writelines(kept)
+            os.replace(self.history_file + ".tmp", self.history_file)
+        except FileNotFoundError:
+            return
+        except OSError as e:
+            syslog.syslog(syslog.LOG_WARNING, f"Can not compact history {self.history_file}: {e}")
+
+    @contextlib.contextmanager
+    def timed(self, stage, disk=""):
+        """Records duration of the block to stage histogram"""
+        started = time.monotonic()
+        try:
+            yield
+        finally:
+            self.timings[(stage, disk)].observe(time.monotonic() - started)
+
+    def dump_timings(self, signum=None, frame=None):
+        """Writes p50/p99/max of every stage to syslog or timings_file. SIGUSR1 handler"""
+        lines = [
+            f"{stage}{f'[{disk}]' if disk else ''}: "
+            f"p50={histogram.quantile(0.5) * 1000:.3f}ms "
+            f"p99={histogram.quantile(0.99) * 1000:.3f}ms "
+            f"max={histogram.max * 1000:.3f}ms n={histogram.count}"
+            for (stage, disk), histogram in sorted(self.timings.items())
+        ]
+        lines.append(f"cycles longer than polling_interval: {self.overruns}")
+        if self.timings_file:
+            try:
+                with open(self.timings_file, "w") as fd:
+                    fd.write("\n".join(lines) + "\n")
+                return
+            except OSError as e:
+                syslog.syslog(syslog.LOG_WARNING, f"Can not write {self.timings_file}: {e}")
+        for line in lines:
+            syslog.syslog(syslog.LOG_INFO, f"Timings: {line}")
+
+    def account(self, disk, command, elapsed, succeeded):
+        """Accounts disk command run in timings and counters"""
+        self.timings[(command, disk)].observe(elapsed)
+        stats = self.stats[disk]
+        stats.commands[command] += 1
+        stats.command_seconds[command] += elapsed
+        if not succeeded:
+            stats.command_failures[command] += 1
+
+    def check_power_modes(self, disks):
+        """
+        Checks power modes of disks with their backends and accounts commands. Disks of backends
+        able to do it are checked in parallel
+        """
+        groups = collections.defaultdict(list)  # (backend, disk or None): disks
+        modes = {}
+        for disk in disks:
+            # Commands would resume device suspended by runtime PM
+            if disk in self.runtime_pm.applied and self.runtime_pm.status(disk) == "suspended":
+                modes[disk] = "STANDBY"
+                continue
+            backend = self.backends[disk]
+            groups[(backend, None if backend.parallel else disk)].append(disk)
+        for (backend, _), group in groups.items():
+            started = time.monotonic()
+            group_modes = backend.power_modes({disk: self.policies[disk].tier for disk in group})
+            elapsed = time.monotonic() - started
+            for disk, mode in group_modes.items():
+                self.account(disk, backend.check_command, elapsed, mode is not None)
+            modes.update(group_modes)
+        return {disk: modes[disk] for disk in disks}
+
+    def mode_checkable(self, disk):
+        """Checks if power mode of disk can be read without waking it"""
+        capabilities = self.capabilities.get(disk, {})
+        return capabilities.get("power_mode_readable", True) and not capabilities.get("probe_wakes")
+
+    def select_backend(self, disk):
+        """Picks backend of disk: from policy, from probed capabilities or detected"""
+        policy = self.base_policies[disk]
+        if policy.protocol != "auto":
+            return self.protocols[policy.protocol]
+        protocol = self.capabilities.get(disk, {}).get("protocol")
+        return self.protocols[protocol if protocol in self.protocols else detect_protocol(disk)]
+
+    def load_capabilities(self):
+        """Reads capability cache once and matches drives to disks"""
+        if self.capability_cache is None:
+            try:
+                with open(self.capabilities_file, "r") as fd:
+                    self.capability_cache = json.load(fd)
+            except FileNotFoundError:
+                self.capability_cache = {}
+            except (OSError, ValueError) as e:
+                syslog.syslog(syslog.LOG_WARNING,
+                              f"Can not read capabilities from {self.capabilities_file}: {e}")
+                self.capability_cache = {}
+        for disk in self.disks:
+            self.identities[disk] = drive_identity(disk)
+            self.capabilities[disk] = self.capability_cache.get(self.identities[disk], {})
+
+    def update_capabilities(self, disk, **capabilities):
+        """Records capabilities of drive and saves cache"""
+        self.capabilities[disk] = dict(self.capabilities.get(disk, {}), **capabilities)
+        self.capability_cache[self.identities[disk]] = self.capabilities[disk]
+        try:
+            write_json(self.capabilities_file, self.capability_cache)
+        except OSError as e:
+            syslog.syslog(syslog.LOG_WARNING,
+                          f"Can not save capabilities to {self.capabilities_file}: {e}")
+
+    def probe_capabilities(self, disks=None):
+        """
+        Probes drives not found in capability cache: protocol and if power mode can be read
+        without waking the drive. With capability_probe=full, drive is also stopped and woken
+        once to learn if standby is honored and how long spin-up takes
+        """
+        if self.capability_probe == "no":
+            return
+        for disk in self.disks if disks is None else disks:
+            capabilities = self.capabilities.get(disk, {})
+            if "protocol" in capabilities and (
+                    self.capability_probe != "full" or "spinup_seconds" in capabilities):
+                continue
+            with self.timed("probe", disk):
+                self.probe_disk(disk)
+            self.repoll(disk)
+
+    def probe_disk(self, disk):
+        tier = self.base_policies[disk].tier
+        detected = detect_protocol(disk)
+        if self.base_policies[disk].protocol != "auto":
+            candidates = [self.base_policies[disk].protocol]
+        else:
+            # SCSI disks may be SAT bridges not behind USB and the other way round
+            candidates = {"scsi": ["scsi", "sat"], "sat": ["sat", "scsi"]}.get(
+                detected, [detected])
+        protocol, mode = candidates[0], None
+        for candidate in candidates:
+            self.backends[disk] = self.protocols[candidate]
+            mode = self.check_power_modes([disk])[disk]
+            if mode is not None:
+                protocol = candidate
+                break
+        self.backends[disk] = self.protocols[protocol]
+        found = {
+            "protocol": protocol, "power_mode_readable": mode is not None, "probed": time.time()}
+        if mode == "STANDBY":
+            # Second check tells if the first one woke drive up
+            found["probe_wakes"] = self.check_power_modes([disk])[disk] == "ACTIVE"
+        if self.capability_probe == "full" and mode is not None:
+            backend = self.backends[disk]
+            if mode == "ACTIVE" and backend.stop(disk, tier):
+                stopped = self.check_power_modes([disk])[disk]
+                found["standby_honored"] = stopped == "STANDBY"
+                if stopped == "STANDBY":
+                    found["probe_wakes"] = self.check_power_modes([disk])[disk] == "ACTIVE"
+            started = time.monotonic()
+            try:
+                wake_disk(disk)
+                found["spinup_seconds"] = round(time.monotonic() - started, 3)
+            except OSError as e:
+                syslog.syslog(syslog.LOG_WARNING, f"Can not wake {disk} up: {e}")
+        self.update_capabilities(disk, **found)
+        syslog.syslog(syslog.LOG_INFO, f"Probed {disk} ({self.identities[disk]}): " + ", ".join(
+            f"{name} {value}" for name, value in sorted(found.items()) if name != "probed"))
+
+    def save_coaccess(self, force=False):
+        """Saves co-access graph if it changed, at most every 10 minutes unless forced"""
+        if self.coaccess is None or not self.coaccess.changed:
+            return
+        if not force and time.monotonic() - self.coaccess_saved < 600:
+            return
+        self.coaccess_saved = time.monotonic()
+        try:
+            write_json(self.coaccess_file, self.coaccess.to_dict(time.time()))
+        except OSError as e:
+            syslog.syslog(syslog.LOG_WARNING,
+                          f"Can not save co-access to {self.coaccess_file}: {e}")
+            return
+        self.coaccess.changed = False
+
+    def save_state(self):
+        """Saves disk states, timers and counters, so they survive daemon restart"""
+        state = {
+            "boot_id": boot_id(),
+            # Timestamps are CLOCK_MONOTONIC, valid only during the same boot
+            "clock": "monotonic",
+            "disks": {
+                disk: {
+                    "state": status[0],
+                    "since": status[1],
+                    "diskstats": self.diskstats.get(disk),
+                    "entered": self.stats[disk].entered,
+                    "stats": self.stats[disk].to_dict(),
+                }
+                for disk, status in self.disk_statuses.items()
+            },
+            # Original values of settings changed by WritebackTuner, in case daemon was killed
+            "writeback": self.writeback.saved,
+            "runtime_pm": self.runtime_pm.saved,
+        }
+        try:
+            write_json(self.state_file, state)
+        except OSError as e:
+            syslog.syslog(syslog.LOG_WARNING, f"Can not save state to {self.state_file}: {e}")
+
+    def restore_state(self):
+        """
+        Restores disk states saved by previous daemon instance in the same boot. State of disk
+        is restored only if its counters did not change in between
+        """
+        try:
+            with open(self.state_file, "r") as fd:
+                state = json.load(fd)
+        except FileNotFoundError:
+            return
+        except (OSError, ValueError) as e:
+            syslog.syslog(syslog.LOG_WARNING, f"Can not read state from {self.state_file}: {e}")
+            return
+        if state.get("boot_id") != boot_id() or state.get("clock") != "monotonic":
+            return
+
+        # Put back settings which were left changed
+        self.writeback.saved = state.get("writeback", {})
+        self.writeback.restore_all()
+        self.runtime_pm.saved = state.get("runtime_pm", {})
+        self.runtime_pm.restore_all()
+
+        restored = []
+        for disk, saved in state.get("disks", {}).items():
+            if disk not in self.disks:
+                continue
+            self.stats[disk].from_dict(saved.get("stats", {}))
+            if saved["diskstats"] != self.diskstats.get(disk):
+                continue
+            # Active disk has not been used since its last activity
+            status = "IDLE" if saved["state"] == "ACTIVE" else saved["state"]
+            self.set_state(disk, status, saved["since"], cause="restored")
+            self.stats[disk].entered = saved.get("entered", saved["since"])
+            # Time in state up to now was written to history by previous instance on exit
+            self.history_marks[disk] = time.monotonic()
+            restored.append(f"{disk}: {status}")
+        if restored:
+            syslog.syslog(syslog.LOG_INFO, f"Restored disks state: {', '.join(restored)}")
+
+    def check_resume(self):
+        """
+        Detects system suspend by growth of CLOCK_BOOTTIME - CLOCK_MONOTONIC. Disks are spun up
+        on resume, so power modes are probed again and all timers start from now
+        """
+        suspended = suspended_time()
+        if suspended - self.suspended < 1:
+            return
+        syslog.syslog(syslog.LOG_INFO,
+                      f"System resumed after {suspended - self.suspended:.0f} seconds of suspend")
+        self.suspended = suspended
+        for status in self.disk_statuses.values():
+            status[1] = time.monotonic()
+        self.probe_power_modes("after resume")
+
+    def probe_power_modes(self, when="at startup", disks=None):
+        """Seeds states with actual power modes, so already stopped disks are not waited for"""
+        disks = self.disks if disks is None else disks
+        modes = self.check_power_modes([disk for disk in disks if self.mode_checkable(disk)])
+        for disk, mode in modes.items():
+            status = self.disk_statuses.get(disk, [None, None])[0]
+            if mode == "STANDBY" and status != "POWEROFF":
+                self.set_state(disk, "POWEROFF", cause=f"power mode {when}")
+            elif mode == "ACTIVE" and status == "POWEROFF":
+                # Spun up without I/O since state was saved
+                self.set_state(disk, "IDLE", cause=f"power mode {when}")
+        syslog.syslog(syslog.LOG_INFO, f"Disks power modes {when}: " + ", ".join(
+            f"{disk}: {mode or 'unknown'}" for disk, mode in modes.items()))
+
+    def collect_smart(self):
+        """Saves SMART attributes of spinning disks to cache directory"""
+        if not self.smart_cache:
+            return
+        for disk in self.disks:
+            if self.disk_statuses.get(disk, [None, None])[0] not in ("ACTIVE", "IDLE"):
+                continue
+            # Passthrough commands restart autosuspend timer, disk would never be suspended
+            if disk in self.runtime_pm.applied:
+                continue
+            last_collected = self.smart_collected.get(disk, float("-inf"))
+            if time.monotonic() - last_collected < self.smart_cache_interval:
+                continue
+            self.smart_collected[disk] = time.monotonic()
+
+            # -n standby: never wake the disk, if it has been stopped by someone else
+            # -c: capabilities with self-test status
+            started = time.monotonic()
+            smartctl = subprocess.Popen(
+                ["smartctl", "-n", "standby", "-j", "-i", "-H", "-c", "-A", f"/dev/{disk}"],
+                stdout=subprocess.PIPE,
+                stderr=subprocess.DEVNULL,
+                universal_newlines=True)
+            output, _ = smartctl.communicate()
+            self.account(
+                disk, "smartctl", time.monotonic() - started, not smartctl.returncode & 0b11)
+            self.repoll(disk)
+            # Bits 0 and 1: command line error, device open failed or device in standby
+            if smartctl.returncode & 0b11:
+                continue
+            try:
+                data = json.loads(output)
+            except ValueError:
+                syslog.syslog(syslog.LOG_WARNING, f"Can not parse smartctl output for {disk}")
+                continue
+            if self_test_running(data):
+                self.self_tests.add(disk)
+            else:
+                self.self_tests.discard(disk)
+
+            collected_at = time.time()
+            try:
+                write_json(os.path.join(self.smart_cache_dir, f"{disk}.json"), {
+                    "disk": disk,
+                    "collected_at": collected_at,
+                    "collected_at_iso": time.strftime(
+                        "%Y-%m-%dT%H:%M:%S%z", time.localtime(collected_at)),
+                    "temperature": data.get("temperature", {}).get("current"),
+                    "smart_passed": data.get("smart_status", {}).get("passed"),
+                    "smartctl": data,
+                })
+            except OSError as e:
+                syslog.syslog(syslog.LOG_WARNING, f"Can not write SMART cache for {disk}: {e}")
+
+    def pin_walk(self, path):
+        """Walks pinned tree. Reads caused by the walk are not treated as disk activity"""
+        disks = self.pinner.trees[path]
+        before = {disk: self.diskstats.get(disk) for disk in disks}
+        entries = self.pinner.walk(path)
+        for disk in disks:
+            self.repoll(disk)
+        if all(self.diskstats.get(disk) == before[disk] for disk in disks):
+            self.pinner.cached_walks += 1
+        return entries
+
+    def pin_metadata(self):
+        """Periodically walks pinned trees while their disks spin"""
+        if self.pinner is None:
+            return
+        # Walks of disks handed to runtime PM would restart their autosuspend timers
+        awake = {
+            disk for disk in self.disks
+            if self.disk_statuses.get(disk, [None, None])[0] in ("ACTIVE", "IDLE")
+            and disk not in self.runtime_pm.applied}
+        for path in self.pinner.due(awake, self.pin_interval):
+            self.pin_walk(path)
+
+    def pin_before_poweroff(self, disk):
+        """Pre-spin-down stage: refresh metadata of all trees on disk"""
+        if self.pinner is None:
+            return
+        for path in self.pinner.trees_of(disk):
+            self.pin_walk(path)
+        if self.pinner.trees_of(disk):
+            syslog.syslog(
+                syslog.LOG_INFO,
+                f"Pinned metadata before {disk} spin-down: "
+                f"{sum(self.pinner.entries.values())} entries, "
+                f"~{self.pinner.memory() // 1024} KiB, "
+                f"{self.pinner.cached_walks} walks served from cache")
+
+    def log_summary(self):
+        """Periodically logs number of disks in every state"""
+        if self.summary_interval <= 0:
+            return
+        if time.monotonic() - self.summary_logged < self.summary_interval:
+            return
+        self.summary_logged = time.monotonic()
+        states = collections.Counter(status[0] for status in self.disk_statuses.values())
+        mesg = "Disks: " + ", ".join(
+            f"{states[state]} {state}" for state in ("ACTIVE", "IDLE", "POWEROFF"))
+        mesg += f"; {self.transitions} transitions"
+        predicted = sum(self.stats[disk].predicted_wakes for disk in self.disks)
+        if predicted:
+            hits = sum(self.stats[disk].prediction_hits for disk in self.disks)
+            saved = sum(self.stats[disk].prediction_saved_seconds for disk in self.disks)
+            mesg += (f"; predictive wakes: {predicted}, hit rate {hits * 100 // predicted}%, "
+                     f"{saved:.0f} seconds of spin-up saved")
+        if self.events.suppressed:
+            mesg += f", {self.events.suppressed} events suppressed"
+        syslog.syslog(syslog.LOG_INFO, mesg)
+        self.transitions = 0
+        self.events.suppressed = 0
+
+    def write_metrics(self):
+        """Atomically writes metrics in Prometheus text format"""
+        if not self.metrics_textfile:
+            return
+        # Metrics update may take at most 1% of daemon time
+        interval = max(self.metrics_interval, self.metrics_cost * 100)
+        if time.monotonic() - self.metrics_written < interval:
+            return
+        started = time.monotonic()
+        self.metrics_written = started
+        try:
+            os.makedirs(os.path.dirname(self.metrics_textfile), exist_ok=True)
+            with open(self.metrics_textfile + ".tmp", "w") as fd:
+                fd.write(self.render_metrics())
+            os.replace(self.metrics_textfile + ".tmp", self.metrics_textfile)
+        except OSError as e:
+            syslog.syslog(syslog.LOG_WARNING, f"Can not write {self.metrics_textfile}: {e}")
+        self.metrics_cost = time.monotonic() - started
+
+    def render_metrics(self):
+        """Returns metrics in Prometheus text format"""
+        now = time.monotonic()
+        lines = []
+
+        def metric(name, kind, help_text, samples):
+            lines.append(f"# HELP disks_poweroff_{name} {help_text}")
+            lines.append(f"# TYPE disks_poweroff_{name} {kind}")
+            for labels, value in samples:
+                if labels:
+                    lines.append(f"disks_poweroff_{name}{{{prometheus_labels(labels)}}} {value}")
+                else:
+                    lines.append(f"disks_poweroff_{name} {value}")
+
+        def state_seconds(disk, state):
+            stats = self.stats[disk]
+            if self.disk_statuses.get(disk, [None])[0] == state:
+                return stats.seconds[state] + now - stats.entered
+            return stats.seconds[state]
+
+        states = ("ACTIVE", "IDLE", "POWEROFF")
+        metric("state", "gauge", "1 if disk is in state", [
+            ({"disk": disk, "state": state},
+             int(self.disk_statuses.get(disk, [None])[0] == state))
+            for disk in self.disks for state in states])
+        metric("state_seconds_total", "counter", "Seconds spent in state", [
+            ({"disk": disk, "state": state}, f"{state_seconds(disk, state):.3f}")
+            for disk in self.disks for state in states])
+        for name, help_text in (
+                ("spindowns", "Disk spin-downs issued"),
+                ("wakeups", "Disk wake-ups after spin-down"),
+                ("false_wakes", "Wake-ups with activity during single poll only"),
+                ("thrashes", "Wake-ups within thrash_window after spin-down"),
+                ("predicted_wakes", "Wake-ups predicted from co-accessed disks"),
+                ("prediction_hits", "Predicted wake-ups used before deadline"),
+                ("prediction_misses", "Predicted wake-ups not used, extra spin-ups"),
+                ("prediction_saved_seconds", "Spin-up time saved by predicted wake-ups")):
+            metric(f"{name}_total", "counter", help_text, [
+                ({"disk": disk}, getattr(self.stats[disk], name)) for disk in self.disks])
+        for name, help_text in (
+                ("commands", "External commands run"),
+                ("command_failures", "External commands failed"),
+                ("command_seconds", "Seconds spent in external commands")):
+            metric(f"{name}_total", "counter", help_text, [
+                ({"disk": disk, "command": command}, f"{count:.6g}")
+                for disk in self.disks
+                for command, count in sorted(getattr(self.stats[disk], name).items())])
+        metric("timeout_backoff", "gauge", "Anti-thrash multiplier of disk timeout", [
+            ({"disk": disk}, f"{self.backoff(disk):.3f}") for disk in self.disks])
+        metric("effective_timeout_seconds", "gauge", "Disk timeout with anti-thrash backoff", [
+            ({"disk": disk}, self.effective_timeout(disk)) for disk in self.disks])
+        energy = {
+            disk: disk_energy(
+                self.base_policies[disk],
+                {state: state_seconds(disk, state) for state in states},
+                self.stats[disk].wakeups)
+            for disk in self.disks}
+        group_energy = {
+            group: {kind: sum(energy[disk][kind] for disk in members) for kind in ENERGY_KINDS}
+            for group, members in sorted(self.groups.items())}
+        for kind, kind_type, help_text in (
+                ("consumed", "counter", "Estimated energy consumed by disk"),
+                ("saved", "counter", "Energy saved against always spinning disk"),
+                ("spinup", "counter", "Energy spent on spin-ups"),
+                ("net", "gauge", "Saved energy minus energy spent on spin-ups")):
+            name = f"energy_{kind}_joules" + ("_total" if kind_type == "counter" else "")
+            metric(name, kind_type, help_text, [
+                ({"disk": disk}, f"{energy[disk][kind]:.1f}") for disk in self.disks])
+            metric(f"group_{name}", kind_type, f"{help_text}, sum over group", [
+                ({"group": group}, f"{values[kind]:.1f}")
+                for group, values in group_energy.items()])
+        metric("wake_offender_sectors", "gauge", "Sectors requested by process which woke disk", [
+            ({"disk": disk, "comm": offender["comm"], "pid": offender["pid"]}, offender["sectors"])
+            for disk, cause in sorted(self.wake_causes.items())
+            for offender in cause["offenders"]])
+        if self.pinner is not None:
+            metric("pinned_metadata_bytes", "gauge", "Estimated memory used by pinned metadata",
+                   [({}, self.pinner.memory())])
+            metric("pinned_cached_walks_total", "counter",
+                   "Walks of pinned trees served without disk reads",
+                   [({}, self.pinner.cached_walks)])
+
+        # Daemon self-metrics
+        histogram = self.poll_duration
+        lines.append("# HELP disks_poweroff_poll_duration_seconds Duration of polling cycle")
+        lines.append("# TYPE disks_poweroff_poll_duration_seconds histogram")
+        cumulative = 0
+        for bucket, count in zip(histogram.buckets + ("+Inf",), histogram.counts):
+            cumulative += count
+            lines.append(
+                f'disks_poweroff_poll_duration_seconds_bucket{{le="{bucket}"}} {cumulative}')
+        lines.append(f"disks_poweroff_poll_duration_seconds_sum {histogram.sum:.6f}")
+        lines.append(f"disks_poweroff_poll_duration_seconds_count {histogram.count}")
+        metric("polls_per_hour", "gauge", "Polling cycles per hour since daemon start",
+               [({}, f"{self.polls * 3600 / max(now - self.started, 1):.1f}")])
+        with open("/proc/self/statm", "r") as fd:
+            rss = int(fd.read().split()[1]) * os.sysconf("SC_PAGE_SIZE")
+        metric("resident_memory_bytes", "gauge", "Resident memory of daemon", [({}, rss)])
+        metric("metrics_update_seconds", "gauge", "Duration of previous metrics update",
+               [({}, f"{self.metrics_cost:.6f}")])
+        return "\n".join(lines) + "\n"
+
+    def attribute_wake(self, disk):
+        """Logs and exports processes which woke the disk up"""
+        if self.wake_tracer is None:
+            return
+        offenders = self.wake_tracer.collect(disk)
+        if offenders:
+            mesg = f"{disk} woken up by: " + ", ".join(
+                f"{comm}[{pid}] {sectors} sectors" + (f" ({', '.join(files)})" if files else "")
+                for comm, pid, sectors, files in offenders)
+        else:
+            mesg = f"{disk} woken up, no process attributed"
+        syslog.syslog(syslog.LOG_INFO, mesg)
+
+        self.wake_causes[disk] = {
+            "time": time.time(),
+            "offenders": [
+                {"comm": comm, "pid": pid, "sectors": sectors, "files": files}
+                for comm, pid, sectors, files in offenders
+            ],
+        }
+        try:
+            write_json(self.wake_causes_file, self.wake_causes)
+        except OSError as e:
+            syslog.syslog(syslog.LOG_WARNING, f"Can not write {self.wake_causes_file}: {e}")
+
+    def open_control_socket(self):
+        if not self.control_socket:
+            return
+        try:
+            os.makedirs(os.path.dirname(self.control_socket), exist_ok=True)
+            if os.path.exists(self.control_socket):
+                os.unlink(self.control_socket)
+            server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            server.bind(self.control_socket)
+            os.chmod(self.control_socket, 0o600)
+            server.listen(4)
+        except OSError as e:
+            syslog.syslog(syslog.LOG_ERR, f"Can not open {self.control_socket}: {e}")
+            return
+        server.setblocking(False)
+        self.selector = selectors.DefaultSelector()
+        self.selector.register(server, selectors.EVENT_READ)
+
+    def wait(self, seconds):
+        """Sleeps, serving control socket meanwhile"""
+        if self.selector is None:
+            time.sleep(seconds)
+            return
+        deadline = time.monotonic() + seconds
         while True:
-            self.poll()
-            self.compare()
-            self.poweroff()
+            timeout = deadline - time.monotonic()
+            if timeout <= 0:
+                return
+            for key, _ in self.selector.select(timeout):
+                try:
+                    connection, _ = key.fileobj.accept()
+                except OSError:
+                    continue
+                self.handle_control(connection)
+
+    def handle_control(self, connection):
+        """Reads one command line from connection and writes JSON response"""
+        with connection:
+            connection.settimeout(1)
+            try:
+                with connection.makefile("r") as fd:
+                    request = fd.readline().split()
+                response = {"ok": True, "result": self.control(request)}
+            except ControlError as e:
+                response = {"ok": False, "error": str(e)}
+            except (OSError, ValueError) as e:
+                response = {"ok": False, "error": f"{type(e).__name__}: {e}"}
+            try:
+                connection.sendall((json.dumps(response) + "\n").encode())
+            except OSError:
+                pass
+
+    def control(self, request):
+        """Executes control command: status, sleep, wake, hold, release, reload, metrics"""
+        if not request:
+            raise ControlError("Empty command")
+        command, args = request[0], request[1:]
+        if command == "status":
+            return self.status()
+        if command == "metrics":
+            return self.render_metrics()
+        if command == "reload":
+            error = self.reload()
+            if error is not None:
+                raise ControlError(error)
+            return "Config reloaded"
+
+        if not args:
+            raise ControlError(f"Usage: {command} DISK")
+        disk = args[0].split("/")[-1]
+        if disk not in self.disks:
+            raise ControlError(f"Unknown disk {disk}")
+        if command == "sleep":
+            self.holds.pop(disk, None)
+            self.spin_down(disk)
+            self.repoll(disk)
+            self.set_state(disk, "POWEROFF", cause="control")
+            return f"{disk} stopped"
+        if command == "wake":
+            wake_disk(disk)
+            self.repoll(disk)
+            self.set_state(disk, "ACTIVE", cause="control")
+            return f"{disk} woken up"
+        if command == "hold":
+            until = None
+            if len(args) > 1:
+                until = time.monotonic() + parse_duration(args[1])
+            if self.disk_statuses.get(disk, [None])[0] == "POWEROFF":
+                wake_disk(disk)
+                self.repoll(disk)
+                self.set_state(disk, "ACTIVE", cause="hold")
+            self.holds[disk] = until
+            return f"{disk} held awake" + (f" for {args[1]}" if until is not None else "")
+        if command == "release":
+            self.holds[disk] = time.monotonic()
+            self.held(disk)
+            return f"{disk} released"
+        raise ControlError(f"Unknown command {command}")
+
+    def status(self):
+        """Returns state of all disks from memory, disks are not touched"""
+        now = time.monotonic()
+        status = []
+        for disk in self.disks:
+            state, since = self.disk_statuses.get(disk, [None, None])
+            hold = None
+            if disk in self.holds:
+                until = self.holds[disk]
+                hold = "forever" if until is None else max(int(until - now), 0)
+            status.append({
+                "disk": disk,
+                "state": state,
+                "state_seconds": int(now - self.stats[disk].entered),
+                "idle_seconds": int(now - since) if state in ("IDLE", "POWEROFF") else 0,
+                "timeout": self.effective_timeout(disk),
+                "tier": self.policies[disk].tier,
+                "nosleep": self.policies[disk].nosleep,
+                "hold": hold,
+                "maintenance": sorted(self.maintenance.get(disk, [])),
+            })
+        return status
+
+    def shutdown(self):
+        """Revert all changes made to the system"""
+        if self.selector is not None:
+            self.selector.close()
+            with contextlib.suppress(OSError):
+                os.unlink(self.control_socket)
+        self.writeback.restore_all()
+        self.runtime_pm.restore_all()
+        self.save_state()
+        self.save_coaccess(force=True)
+        self.flush_history(force=True)
+        if self.wake_tracer is not None:
+            self.wake_tracer.close()
+        if self.pinner is not None:
+            self.pinner.close()
+
+    def run(self):
+        signal.signal(signal.SIGUSR1, self.dump_timings)
+        signal.signal(signal.SIGHUP, self.request_reload)
+        self.open_control_socket()
+        self.poll()
+        self.restore_state()
+        self.probe_capabilities()
+        self.probe_power_modes()
+        try:
+            while True:
+                started = time.monotonic()
+                if self.reload_requested:
+                    self.reload()
+                self.apply_schedules()
+                self.check_resume()
+                with self.timed("maintenance"):
+                    self.check_maintenance()
+                with self.timed("poll"):
+                    self.poll()
+                with self.timed("compare"):
+                    self.compare()
+                with self.timed("scrubs"):
+                    self.check_scrubs()
+                with self.timed("poweroff"):
+                    self.poweroff()
+                with self.timed("smart"):
+                    self.collect_smart()
+                with self.timed("pin"):
+                    self.pin_metadata()
+                elapsed = time.monotonic() - started
+                self.poll_duration.observe(elapsed)
+                self.polls += 1
+                if elapsed > self.polling_interval:
+                    self.overruns += 1
+                self.write_metrics()
 
-            if self.dump_log:
-                mesg = "Disks state changed: " + " ".join(
-                    [f"{k}: {self.disk_statuses.get(k, [None, None])[0]}; "
-                     for k in self.disk_statuses]
-                )
-                syslog.syslog(syslog.LOG_INFO, mesg)
-                self.dump_log = False
+                if self.state_changed:
+                    self.state_changed = False
+                    self.save_state()
+                self.save_coaccess()
+                self.flush_history()
+                self.log_summary()
 
-            time.sleep(self.polling_interval)
+                self.wait(self.polling_interval)
+        finally:
+            self.shutdown()
+
+
+def terminate(signum, frame):
+    """Turn SIGTERM into SystemExit, so cleanup code runs"""
+    sys.exit(0)
+
+
+def read_json(path, default):
+    """Reads JSON file, returns default if it is missing or broken"""
+    try:
+        with open(path, "r") as fd:
+            return json.load(fd)
+    except FileNotFoundError:
+        return default
+    except (OSError, ValueError) as e:
+        syslog.syslog(syslog.LOG_WARNING, f"Can not read {path}: {e}")
+        return default
+
+
+def read_config(configfile):
+    config = configparser.ConfigParser()
+    config.read(configfile)
+    if "disks-poweroff" not in config:
+        config["disks-poweroff"] = {}
+    return config
+
+
+def control_request(path, command):
+    """Sends command line to control socket of running daemon, returns its response"""
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as connection:
+        connection.settimeout(60)
+        connection.connect(path)
+        connection.sendall((command + "\n").encode())
+        with connection.makefile("r") as fd:
+            return json.loads(fd.readline())
+
+
+def ctl(argv):
+    """disks-poweroff ctl: sends command to running daemon"""
+    parser = argparse.ArgumentParser(
+        prog="disks-poweroff.py ctl",
+        description="Control running daemon. Commands: status, sleep DISK, wake DISK, "
+                    "hold DISK [DURATION], release DISK, reload, metrics")
+    parser.add_argument("-c", "--config", default="/etc/disks-poweroff.conf")
+    parser.add_argument("--json", action="store_true", help="print raw JSON response")
+    parser.add_argument("command", nargs="+")
+    args = parser.parse_args(argv)
+
+    path = read_config(args.config)["disks-poweroff"].get(
+        "control_socket", "/run/disks-poweroff/control.sock")
+    response = control_request(path, " ".join(args.command))
+
+    if args.json:
+        print(json.dumps(response, indent=1))
+    elif not response["ok"]:
+        print(response["error"], file=sys.stderr)
+    elif args.command[0] == "status":
+        print(f"{'DISK':8} {'STATE':9} {'IN STATE':>9} {'IDLE':>9} {'TIMEOUT':>8} "
+              f"{'TIER':8} HOLD")
+        for disk in response["result"]:
+            hold = disk["hold"]
+            if isinstance(hold, int):
+                hold = f"{hold}s"
+            if disk.get("maintenance"):
+                hold = ",".join(disk["maintenance"])
+            print(f"{disk['disk']:8} {disk['state'] or 'UNKNOWN':9} {disk['state_seconds']:>8}s "
+                  f"{disk['idle_seconds']:>8}s {disk['timeout']:>7}s {disk['tier']:8} "
+                  f"{hold or '-'}")
+    else:
+        print(response["result"].rstrip("\n"))
+    return 0 if response["ok"] else 1
+
+
+def profile(argv):
+    """
+    disks-poweroff profile: puts disk to every tier its protocol supports and measures time to
+    first byte of O_DIRECT read of random sector. Results are kept per drive identity, so
+    spin-up time can be followed across months
+    """
+    parser = argparse.ArgumentParser(
+        prog="disks-poweroff.py profile",
+        description="Measure wake-up latency of disk from every power tier")
+    parser.add_argument("-c", "--config", default="/etc/disks-poweroff.conf")
+    parser.add_argument("--runs", type=int, default=1, help="measurements per tier")
+    parser.add_argument("--settle", type=float, default=10,
+                        help="seconds to wait after stopping disk")
+    parser.add_argument("disk")
+    args = parser.parse_args(argv)
+
+    config = read_config(args.config)["disks-poweroff"]
+    disk = args.disk.strip().split("/")[-1]
+    identity = drive_identity(disk)
+    profiles_file = config.get("profiles_file", "/var/lib/disks-poweroff/profiles.json")
+    try:
+        with open(config.get(
+                "capabilities_file", "/var/lib/disks-poweroff/capabilities.json"), "r") as fd:
+            protocol = json.load(fd).get(identity, {}).get("protocol")
+    except (OSError, ValueError):
+        protocol = None
+    backend = BACKENDS[protocol if protocol in BACKENDS else detect_protocol(disk)]()
+    try:
+        with open(profiles_file, "r") as fd:
+            profiles = json.load(fd)
+    except FileNotFoundError:
+        profiles = {}
+
+    # Keep running daemon from stopping or rechecking disk meanwhile
+    control_socket = config.get("control_socket", "/run/disks-poweroff/control.sock")
+    try:
+        held = control_request(control_socket, f"hold {disk}")["ok"]
+    except OSError:
+        held = False
+
+    results = collections.defaultdict(list)  # tier: seconds
+    try:
+        for _ in range(args.runs):
+            started = time.monotonic()
+            wake_disk(disk)
+            results["active"].append(time.monotonic() - started)
+            for tier in backend.tiers:
+                if not backend.stop(disk, tier):
+                    print(f"{tier}: {backend.stop_command} failed", file=sys.stderr)
+                    continue
+                time.sleep(args.settle)
+                if backend.power_modes({disk: tier})[disk] == "ACTIVE":
+                    print(f"{tier}: disk did not enter tier", file=sys.stderr)
+                    continue
+                started = time.monotonic()
+                wake_disk(disk)
+                results[tier].append(time.monotonic() - started)
+    finally:
+        if held:
+            control_request(control_socket, f"release {disk}")
+
+    history = profiles.setdefault(identity, {})
+    print(f"{disk} ({identity})")
+    print(f"{'TIER':10} {'NOW':>9} {'MEDIAN':>9} {'FIRST':>9} RUNS")
+    for tier, samples in results.items():
+        runs = history.setdefault(tier, [])
+        runs.extend([round(time.time()), round(seconds, 4)] for seconds in samples)
+        del runs[:-100]
+        samples = sorted(samples)
+        recorded = sorted(seconds for _, seconds in runs)
+        print(f"{tier:10} {samples[len(samples) // 2]:>8.3f}s "
+              f"{recorded[len(recorded) // 2]:>8.3f}s {runs[0][1]:>8.3f}s {len(runs)}")
+    write_json(profiles_file, profiles)
+    return 0
+
+
+def report(argv):
+    """disks-poweroff report: energy balance of disks and groups from recorded history"""
+    parser = argparse.ArgumentParser(
+        prog="disks-poweroff.py report",
+        description="Energy saved by spinning disks down, from recorded state history")
+    parser.add_argument("-c", "--config", default="/etc/disks-poweroff.conf")
+    parser.add_argument("--since", default="30d",
+                        help="start date YYYY-MM-DD or duration like 7d (default: 30d)")
+    args = parser.parse_args(argv)
+
+    config = read_config(args.config)
+    section = config["disks-poweroff"]
+    try:
+        since = time.mktime(datetime.datetime.strptime(args.since, "%Y-%m-%d").timetuple())
+    except ValueError:
+        since = time.time() - parse_duration(args.since)
+
+    seconds = collections.defaultdict(collections.Counter)  # disk: state: seconds
+    wakeups = collections.Counter()
+    drives = {}
+    try:
+        with open(section.get("history_file", "/var/lib/disks-poweroff/history.jsonl")) as fd:
+            for line in fd:
+                try:
+                    record = json.loads(line)
+                except ValueError:
+                    continue
+                if record["time"] < since:
+                    continue
+                disk = record["disk"]
+                states = record.get("states", {})
+                # Only part of the states after since counts
+                total = sum(states.values())
+                share = min(1, (record["time"] - since) / total) if total else 0
+                for state, state_seconds in states.items():
+                    seconds[disk][state] += state_seconds * share
+                if record.get("from") == "POWEROFF" and record.get("to") == "ACTIVE":
+                    wakeups[disk] += 1
+                drives[disk] = record.get("drive")
+    except FileNotFoundError:
+        pass
+
+    disks = sorted(seconds)
+    groups = {}
+    policies = compile_policies(
+        config, disks, default_policy(
+            section, config_option(section, "timeout", 1800, parse_seconds, minimum=0)), groups)
+    profiles = read_json(
+        section.get("profiles_file", "/var/lib/disks-poweroff/profiles.json"), {})
+    energy = {}
+    for disk in disks:
+        measured = profiled_spinup(profiles, drives[disk], policies[disk].tier)
+        if measured is not None:
+            policies[disk].spinup_seconds = measured
+        energy[disk] = disk_energy(policies[disk], seconds[disk], wakeups[disk])
+
+    def row(name, values, standby, spinups):
+        kwh = {kind: values[kind] / 3.6e6 for kind in ENERGY_KINDS}
+        print(f"{name:24} {standby / 3600:>9.1f} {spinups:>8} {kwh['consumed']:>9.3f} "
+              f"{kwh['saved']:>9.3f} {kwh['spinup']:>9.3f} {kwh['net']:>9.3f}")
+
+    print(f"Since {time.strftime('%Y-%m-%d %H:%M', time.localtime(since))}, energy in kWh")
+    print(f"{'DISK':24} {'STANDBY H':>9} {'SPINUPS':>8} {'CONSUMED':>9} {'SAVED':>9} "
+          f"{'SPIN-UPS':>9} {'NET':>9}")
+    for disk in disks:
+        row(disk, energy[disk], seconds[disk]["POWEROFF"], wakeups[disk])
+    for group, members in sorted(groups.items()):
+        row(f"group:{group}",
+            {kind: sum(energy[disk][kind] for disk in members) for kind in ENERGY_KINDS},
+            sum(seconds[disk]["POWEROFF"] for disk in members),
+            sum(wakeups[disk] for disk in members))
+    row("total", {kind: sum(energy[disk][kind] for disk in disks) for kind in ENERGY_KINDS},
+        sum(seconds[disk]["POWEROFF"] for disk in disks), sum(wakeups.values()))
+    return 0
 
 
 def main():
+    if len(sys.argv) > 1 and sys.argv[1] == "ctl":
+        sys.exit(ctl(sys.argv[2:]))
+    if len(sys.argv) > 1 and sys.argv[1] == "profile":
+        sys.exit(profile(sys.argv[2:]))
+    if len(sys.argv) > 1 and sys.argv[1] == "report":
+        sys.exit(report(sys.argv[2:]))
+
+    signal.signal(signal.SIGTERM, terminate)
     disks_poweroff = DisksPowerOff(sys.argv[1])
     disks_poweroff.run()
 
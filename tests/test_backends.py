@@ -0,0 +1,296 @@
+# Tests of SCSI, SAT and NVMe backends with fake ioctl, no hardware needed:
+#
+#     python3 -m unittest discover -s tests
+
+import ctypes
+import importlib.util
+import os
+import unittest
+from unittest import mock
+
+spec = importlib.util.spec_from_file_location(
+    "disks_poweroff", os.path.join(os.path.dirname(__file__), "..", "src", "disks-poweroff.py"))
+dp = importlib.util.module_from_spec(spec)
+spec.loader.exec_module(dp)
+
+
+def fixed_sense(key, asc, ascq, information=b"\0\0\0\0"):
+    """Fixed format sense data"""
+    return bytes([0x70, 0, key, *information, 10, 0, 0, 0, 0, asc, ascq, 0, 0, 0, 0])
+
+
+def descriptor_sense(key, asc, ascq, descriptors=b""):
+    """Descriptor format sense data"""
+    return bytes([0x72, key, asc, ascq, 0, 0, 0, len(descriptors)]) + descriptors
+
+
+def ata_status_descriptor(status, count, error=0):
+    """ATA Status Return sense data descriptor"""
+    return bytes([0x09, 0x0C, 0, error, 0, count, 0, 0, 0, 0, 0, 0, 0, status])
+
+
+class FakeSg:
+    """
+    SG_IO handler: answers every CDB with handler(cdb), which returns SCSI status, data and
+    sense data, or raises OSError. Sent CDBs are recorded
+    """
+
+    def __init__(self, handler):
+        self.handler = handler
+        self.cdbs = []
+
+    def __call__(self, fd, request, header):
+        assert request == dp.SG_IO
+        cdb = list(ctypes.string_at(header.cmdp, header.cmd_len))
+        self.cdbs.append(cdb)
+        status, data, sense = self.handler(cdb)
+        data = data[:header.dxfer_len]
+        if data:
+            ctypes.memmove(header.dxferp, data, len(data))
+        header.resid = header.dxfer_len - len(data)
+        sense = sense[:header.mx_sb_len]
+        if sense:
+            ctypes.memmove(header.sbp, sense, len(sense))
+        header.sb_len_wr = len(sense)
+        header.status = status
+        return 0
+
+
+class FakeNvme:
+    """NVMe admin command handler: handler(opcode, cdw10, cdw11) returns status, result, data"""
+
+    def __init__(self, handler):
+        self.handler = handler
+        self.commands = []
+
+    def __call__(self, fd, request, command):
+        assert request == dp.NVME_IOCTL_ADMIN_CMD
+        self.commands.append((command.opcode, command.cdw10, command.cdw11))
+        status, result, data = self.handler(command.opcode, command.cdw10, command.cdw11)
+        data = data[:command.data_len]
+        if data:
+            ctypes.memmove(command.addr, data, len(data))
+        command.result = result
+        return status
+
+
+class BackendTestCase(unittest.TestCase):
+    """Device nodes are not opened, syslog is silenced"""
+
+    def setUp(self):
+        for patcher in (
+                mock.patch.object(dp.os, "open", return_value=-1),
+                mock.patch.object(dp.os, "close"),
+                mock.patch.object(dp.syslog, "syslog")):
+            patcher.start()
+            self.addCleanup(patcher.stop)
+
+
+class SenseTest(unittest.TestCase):
+    def test_parse_fixed(self):
+        self.assertEqual(dp.parse_sense(fixed_sense(0x2, 0x04, 0x02)), (0x2, 0x04, 0x02))
+
+    def test_parse_descriptor(self):
+        self.assertEqual(dp.parse_sense(descriptor_sense(0x0, 0x5E, 0x0A)), (0x0, 0x5E, 0x0A))
+
+    def test_parse_short_or_unknown(self):
+        self.assertEqual(dp.parse_sense(b""), (None, None, None))
+        self.assertEqual(dp.parse_sense(bytes([0x70, 0, 0x2])), (None, None, None))
+        self.assertEqual(dp.parse_sense(bytes(18)), (None, None, None))
+
+    def test_ata_return_descriptor(self):
+        sense = descriptor_sense(
+            0x1, 0x00, 0x1D, bytes([0x0A, 2, 0, 0]) + ata_status_descriptor(0x50, 0xFF))
+        self.assertEqual(dp.ata_return(sense), (0x50, 0xFF))
+
+    def test_ata_return_descriptor_missing(self):
+        self.assertIsNone(dp.ata_return(descriptor_sense(0x1, 0x00, 0x1D)))
+
+    def test_ata_return_fixed(self):
+        # INFORMATION field: ERROR, STATUS, DEVICE, COUNT
+        sense = fixed_sense(0x1, 0x00, 0x1D, bytes([0x00, 0x50, 0x40, 0x00]))
+        self.assertEqual(dp.ata_return(sense), (0x50, 0x00))
+
+    def test_ata_return_other_sense(self):
+        self.assertIsNone(dp.ata_return(fixed_sense(0x5, 0x20, 0x00)))
+
+
+class SgIoTest(unittest.TestCase):
+    def test_data_and_sense(self):
+        fake = FakeSg(lambda cdb: (0x02, b"\x01\x02\x03", fixed_sense(0x6, 0x29, 0x00)))
+        status, data, sense = dp.sg_io(-1, [0x12, 0, 0, 0, 36, 0], 36, ioctl=fake)
+        self.assertEqual(fake.cdbs, [[0x12, 0, 0, 0, 36, 0]])
+        self.assertEqual((status, data), (0x02, b"\x01\x02\x03"))
+        self.assertEqual(dp.parse_sense(sense), (0x6, 0x29, 0x00))
+
+    def test_transport_error(self):
+        def ioctl(fd, request, header):
+            header.host_status = 0x01  # DID_NO_CONNECT
+        with self.assertRaises(OSError):
+            dp.sg_io(-1, [0x00] * 6, ioctl=ioctl)
+
+    def test_driver_sense_is_not_error(self):
+        def ioctl(fd, request, header):
+            header.driver_status = 0x08  # DRIVER_SENSE
+        self.assertEqual(dp.sg_io(-1, [0x00] * 6, ioctl=ioctl), (0, b"", b""))
+
+
+class ScsiBackendTest(BackendTestCase):
+    def test_start_stop_unit(self):
+        fake = FakeSg(lambda cdb: (0, b"", b""))
+        backend = dp.ScsiBackend(ioctl=fake)
+        for tier in ("idle_b", "idle_c", "standby_y", "standby_z", "sleep"):
+            self.assertTrue(backend.stop("sdb", tier))
+        self.assertEqual(fake.cdbs, [
+            [0x1B, 0, 0, 0x1, 0x20, 0],
+            [0x1B, 0, 0, 0x2, 0x20, 0],
+            [0x1B, 0, 0, 0x1, 0x30, 0],
+            [0x1B, 0, 0, 0x0, 0x30, 0],
+            [0x1B, 0, 0, 0x0, 0x30, 0],
+        ])
+
+    def test_stop_failure(self):
+        backend = dp.ScsiBackend(ioctl=FakeSg(lambda cdb: (0x02, b"", fixed_sense(0x5, 0x24, 0))))
+        self.assertFalse(backend.stop("sdb", "standby_z"))
+
+    def test_power_condition_from_request_sense(self):
+        senses = {
+            "sdb": descriptor_sense(0x0, 0x5E, 0x0A),  # standby_y by command
+            "sdc": fixed_sense(0x0, 0x5E, 0x07),  # idle_c by timer
+            "sdd": fixed_sense(0x2, 0x04, 0x02),  # stopped
+            "sde": fixed_sense(0x0, 0x00, 0x00),  # active
+        }
+        disks = iter(["sdb", "sdc", "sdd", "sde"])
+        fake = FakeSg(lambda cdb: (0, senses[next(disks)], b""))
+        backend = dp.ScsiBackend(ioctl=fake)
+        modes = backend.power_modes(
+            {"sdb": "standby_y", "sdc": "standby_y", "sdd": "standby_z", "sde": "idle_b"})
+        self.assertEqual(
+            modes, {"sdb": "STANDBY", "sdc": "ACTIVE", "sdd": "STANDBY", "sde": "ACTIVE"})
+        self.assertEqual(fake.cdbs[0], [0x03, 0, 0, 0, 252, 0])
+
+    def test_power_condition_unknown(self):
+        def handler(cdb):
+            raise OSError("no device")
+        backend = dp.ScsiBackend(ioctl=FakeSg(handler))
+        self.assertEqual(backend.power_modes({"sdb": "standby_z"}), {"sdb": None})
+
+
+class SatBackendTest(BackendTestCase):
+    def setUp(self):
+        super().setUp()
+        patcher = mock.patch.object(dp, "bridge_id", return_value="152d:0578")
+        patcher.start()
+        self.addCleanup(patcher.stop)
+
+    def test_pass_through_cdb(self):
+        cdb16 = dp.SatBackend.pass_through(16, 0xE5, True)
+        self.assertEqual(len(cdb16), 16)
+        self.assertEqual(cdb16[:3], [0x85, 0x06, 0x20])
+        self.assertEqual(cdb16[14], 0xE5)
+        cdb12 = dp.SatBackend.pass_through(12, 0xE0, False)
+        self.assertEqual(len(cdb12), 12)
+        self.assertEqual(cdb12[:3], [0xA1, 0x06, 0x00])
+        self.assertEqual(cdb12[9], 0xE0)
+
+    def bridge(self, count):
+        """Bridge without ATA PASS-THROUGH(16), answering CHECK POWER MODE with count"""
+        def handler(cdb):
+            if cdb[0] == 0x85:
+                return 0x02, b"", fixed_sense(0x5, 0x20, 0x00)  # INVALID COMMAND OPERATION CODE
+            if cdb[9] == 0xE5:
+                return 0x02, b"", descriptor_sense(
+                    0x1, 0x00, 0x1D, ata_status_descriptor(0x50, count))
+            return 0, b"", b""
+        return FakeSg(handler)
+
+    def test_variant_found_and_cached(self):
+        fake = self.bridge(0x00)
+        backend = dp.SatBackend(ioctl=fake)
+        self.assertEqual(backend.power_modes({"sdb": "standby"}), {"sdb": "STANDBY"})
+        self.assertTrue(backend.stop("sdb", "sleep"))
+        self.assertEqual(backend.variants, {"152d:0578": 12})
+        self.assertEqual([cdb[0] for cdb in fake.cdbs], [0x85, 0xA1, 0xA1, 0xA1])
+        self.assertEqual(fake.cdbs[-1][9], 0xE0)
+
+    def test_active(self):
+        backend = dp.SatBackend(ioctl=self.bridge(0xFF))
+        self.assertEqual(backend.power_modes({"sdb": "standby"}), {"sdb": "ACTIVE"})
+
+    def test_no_working_variant(self):
+        fake = FakeSg(lambda cdb: (0x02, b"", fixed_sense(0x5, 0x20, 0x00)))
+        backend = dp.SatBackend(ioctl=fake)
+        self.assertEqual(backend.power_modes({"sdb": "standby"}), {"sdb": None})
+        self.assertFalse(backend.stop("sdb", "standby"))
+        self.assertEqual(len(fake.cdbs), 2)  # both variants tried once
+
+
+def identify_controller(states):
+    """Identify Controller data with power state descriptors, states are (exit latency, NOPS)"""
+    data = bytearray(4096)
+    data[263] = len(states) - 1  # NPSS is zero based
+    for index, (exit_latency, nops) in enumerate(states):
+        descriptor = 2048 + index * 32
+        data[descriptor + 3] = 0x02 if nops else 0x00
+        data[descriptor + 8:descriptor + 12] = exit_latency.to_bytes(4, "little")
+    return bytes(data)
+
+
+class NvmeBackendTest(BackendTestCase):
+    def controller(self, power_state, states, status=0):
+        """Controller in power_state, Get Features fails with status"""
+        identify = identify_controller(states)
+
+        def handler(opcode, cdw10, cdw11):
+            if opcode == dp.NvmeBackend.IDENTIFY:
+                self.assertEqual(cdw10, 1)
+                return 0, 0, identify
+            if opcode == dp.NvmeBackend.GET_FEATURES and cdw10 == dp.NvmeBackend.APST:
+                return 0, 1, b""
+            if opcode == dp.NvmeBackend.GET_FEATURES:
+                return status, power_state, b""
+            return 0, 0, b""
+        return FakeNvme(handler)
+
+    # PS0-PS2 operational, PS3 and PS4 non-operational, PS4 exits faster
+    STATES = [(0, False), (0, False), (0, False), (8000, True), (2000, True)]
+
+    def test_power_states_sorted_by_exit_latency(self):
+        backend = dp.NvmeBackend(ioctl=self.controller(0, self.STATES))
+        self.assertEqual(backend.power_states("nvme0n1"), [4, 3])
+
+    def test_power_states_cached(self):
+        fake = self.controller(0, self.STATES)
+        backend = dp.NvmeBackend(ioctl=fake)
+        backend.power_states("nvme0n1")
+        backend.power_states("nvme0n1")
+        opcodes = [opcode for opcode, _, _ in fake.commands]
+        self.assertEqual(opcodes.count(dp.NvmeBackend.IDENTIFY), 1)
+
+    def test_power_modes(self):
+        for power_state, mode in ((3, "STANDBY"), (4, "STANDBY"), (2, "ACTIVE")):
+            backend = dp.NvmeBackend(ioctl=self.controller(power_state, self.STATES))
+            self.assertEqual(backend.power_modes({"nvme0n1": "sleep"}), {"nvme0n1": mode})
+
+    def test_power_mode_unknown_on_error(self):
+        backend = dp.NvmeBackend(ioctl=self.controller(3, self.STATES, status=0x4002))
+        self.assertEqual(backend.power_modes({"nvme0n1": "sleep"}), {"nvme0n1": None})
+
+    def test_stop_tiers(self):
+        fake = self.controller(0, self.STATES)
+        backend = dp.NvmeBackend(ioctl=fake)
+        self.assertTrue(backend.stop("nvme0n1", "standby"))
+        self.assertTrue(backend.stop("nvme0n1", "sleep"))
+        set_features = [
+            (cdw10, cdw11) for opcode, cdw10, cdw11 in fake.commands
+            if opcode == dp.NvmeBackend.SET_FEATURES]
+        self.assertEqual(set_features, [
+            (dp.NvmeBackend.POWER_MANAGEMENT, 4), (dp.NvmeBackend.POWER_MANAGEMENT, 3)])
+
+    def test_stop_without_nonoperational_states(self):
+        backend = dp.NvmeBackend(ioctl=self.controller(0, [(0, False), (0, False)]))
+        self.assertFalse(backend.stop("nvme0n1", "sleep"))
+
+
+if __name__ == "__main__":
+    unittest.main()